@@ -0,0 +1,216 @@
+/*
+ Copyright (C) 2011 Georgia Institute of Technology
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+ * Random-access storage for one stimulus channel. Samples are kept either as
+ * doubles or as 32-bit or 16-bit fixed-point codes with a per-channel scale
+ * and offset (value = offset + scale * code). The offset is a whole number of
+ * steps so that zero, used to pad the wait between trials, is stored exactly.
+ * A channel that holds one value throughout stores no samples at all. Single
+ * samples can be overwritten in place while other indices are being read.
+ */
+
+#ifndef G_WAVEFORM_BUFFER_H
+#define G_WAVEFORM_BUFFER_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class StimulusBuffer
+{
+
+public:
+    enum storage_t { DOUBLE, FIXED32, FIXED16, CONSTANT };
+
+    StimulusBuffer(void) : mode(DOUBLE), scale(1), offset(0), steps(0), length(0) {}
+
+    double operator[](size_t i) const
+    {
+        switch (mode) {
+        case FIXED16:
+            return offset + scale * q16[i];
+        case FIXED32:
+            return offset + scale * q32[i];
+        case CONSTANT:
+            return offset;
+        default:
+            return raw[i];
+        }
+    }
+
+    size_t size(void) const
+    {
+        return mode == FIXED16 ? q16.size() : mode == FIXED32 ? q32.size()
+               : mode == CONSTANT ? length : raw.size();
+    }
+
+    bool empty(void) const
+    {
+        return size() == 0;
+    }
+
+    size_t bytes(void) const
+    {
+        return q16.capacity() * sizeof(int16_t) + q32.capacity() * sizeof(int32_t)
+               + raw.capacity() * sizeof(double);
+    }
+
+    storage_t storage(void) const
+    {
+        return mode;
+    }
+
+    void clear(void)
+    {
+        length = 0;
+        std::vector<double>().swap(raw);
+        std::vector<int32_t>().swap(q32);
+        std::vector<int16_t>().swap(q16);
+    }
+
+    // Empty the buffer and prepare it for values in [lo, hi] appended with push_back().
+    void reset(storage_t storage, double lo, double hi)
+    {
+        clear();
+        mode = storage;
+        setRange(lo, hi);
+    }
+
+    void push_back(double value)
+    {
+        switch (mode) {
+        case FIXED16:
+            q16.push_back(encode(value));
+            break;
+        case FIXED32:
+            q32.push_back(encode(value));
+            break;
+        case CONSTANT: // the value is fixed by assignConstant()
+            length++;
+            break;
+        default:
+            raw.push_back(value);
+            break;
+        }
+    }
+
+    // Overwrite sample i, which must exist. Fixed-point values are clamped to the range.
+    void set(size_t i, double value)
+    {
+        switch (mode) {
+        case FIXED16:
+            q16[i] = encode(value);
+            break;
+        case FIXED32:
+            q32[i] = encode(value);
+            break;
+        case CONSTANT:
+            break;
+        default:
+            raw[i] = value;
+            break;
+        }
+    }
+
+    // Read as value at each of n indices without storing any samples.
+    void assignConstant(double value, size_t n)
+    {
+        clear();
+        mode = CONSTANT;
+        scale = 1;
+        offset = value;
+        steps = 0;
+        length = n;
+    }
+
+    // Replace the contents with samples followed by padding zeros. Returns the
+    // largest absolute difference between a sample and its stored value.
+    double assign(storage_t storage, const std::vector<double> &samples, size_t padding)
+    {
+        double lo = 0, hi = 0;
+        for (size_t i = 0; i < samples.size(); i++) {
+            if (std::isfinite(samples[i])) {
+                lo = std::min(lo, samples[i]);
+                hi = std::max(hi, samples[i]);
+            }
+        }
+        reset(storage, lo, hi);
+        reserve(samples.size() + padding);
+        double error = 0;
+        for (size_t i = 0; i < samples.size(); i++) {
+            push_back(samples[i]);
+            if (!std::isfinite(samples[i]))
+                error = mode == DOUBLE ? error : std::numeric_limits<double>::infinity();
+            else
+                error = std::max(error, std::fabs((*this)[size() - 1] - samples[i]));
+        }
+        for (size_t i = 0; i < padding; i++)
+            push_back(0);
+        return error;
+    }
+
+private:
+    storage_t mode;
+    double scale;
+    double offset;
+    int64_t steps; // offset / scale
+    size_t length; // samples of a CONSTANT buffer
+    std::vector<double> raw;
+    std::vector<int32_t> q32;
+    std::vector<int16_t> q16;
+
+    int64_t maxcode(void) const
+    {
+        return mode == FIXED16 ? std::numeric_limits<int16_t>::max()
+               : std::numeric_limits<int32_t>::max();
+    }
+
+    void reserve(size_t n)
+    {
+        if (mode == FIXED16) q16.reserve(n);
+        else if (mode == FIXED32) q32.reserve(n);
+        else if (mode == DOUBLE) raw.reserve(n);
+    }
+
+    void setRange(double lo, double hi)
+    {
+        scale = 1;
+        offset = 0;
+        steps = 0;
+        if (mode == DOUBLE || mode == CONSTANT || !(hi > lo))
+            return;
+        // one spare step on each side absorbs rounding of the offset
+        scale = (hi - lo) / (2.0 * (maxcode() - 1));
+        steps = llround((hi + lo) / 2 / scale);
+        offset = steps * scale;
+    }
+
+    int64_t encode(double value) const
+    {
+        if (!std::isfinite(value))
+            return -steps; // store non-finite samples as zero
+        int64_t code = llround(value / scale) - steps;
+        return std::max(-maxcode(), std::min(maxcode(), code));
+    }
+};
+
+#endif
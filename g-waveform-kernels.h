@@ -0,0 +1,167 @@
+/*
+ Copyright (C) 2011 Georgia Institute of Technology
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+ * Kernels for the dynamic clamp current, the laser TTL train, Vm prediction and
+ * the stimulus file parser. They depend on neither RTXI nor Qt so that the
+ * golden-trace tests in tests/ can check them against the original code sample
+ * for sample on any machine. Changing the order of the arithmetic here changes
+ * the output bits.
+ */
+
+#ifndef G_WAVEFORM_KERNELS_H
+#define G_WAVEFORM_KERNELS_H
+
+#include <cctype>
+#include <cmath>
+#include <locale.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "g-waveform-buffer.h"
+
+// Toggles and parameters of the current computation, in SI units
+struct ClampSettings {
+    bool currenton;
+    bool ampaon;
+    bool gabaon;
+    bool nmdaon;
+    bool clampon;
+    bool laserTTLon;
+    double AMPArev;
+    double AMPAgain;
+    double GABArev;
+    double GABAgain;
+    double NMDArev;
+    double NMDAgain;
+    double P1;
+    double P2;
+};
+
+// Current (A) through conductance g (S) with reversal potential rev (V) at membrane potential Vm (V)
+inline double synapticCurrent(double g, double Vm, double rev, double gain)
+{
+    return -1 * g * (Vm - rev) * gain;
+}
+
+// NMDA current with voltage-dependent magnesium block set by P1 and P2
+inline double nmdaCurrent(double g, double Vm, double rev, double P1, double P2, double gain)
+{
+    return -1 * g * (Vm - rev) * 1 / (1 + P1 * exp(-P2 * Vm)) * gain;
+}
+
+// Outputs 0-4 (command, AMPA, GABA, NMDA, laser TTL) for one tick of a trial after
+// the wait, given the stimulus samples of that tick and the Vm for the driving force
+inline void clampOutputs(const ClampSettings &s, double Vm, double current, double gAMPA,
+                         double gGABA, double gNMDA, double ttl, double out[5])
+{
+    if (s.clampon) {
+        out[1] = s.ampaon ? synapticCurrent(gAMPA, Vm, s.AMPArev, s.AMPAgain) : 0;
+        out[2] = s.gabaon ? synapticCurrent(gGABA, Vm, s.GABArev, s.GABAgain) : 0;
+        out[3] = s.nmdaon ? nmdaCurrent(gNMDA, Vm, s.NMDArev, s.P1, s.P2, s.NMDAgain) : 0;
+        out[0] = out[1] + out[2] + out[3];
+        if (s.currenton) out[0] = out[0] + current;
+    } else {
+        out[1] = 0;
+        out[2] = 0;
+        out[3] = 0;
+        out[0] = 0;
+    }
+    out[4] = s.laserTTLon ? ttl : 0;
+}
+
+// Extrapolate Vm s sample periods ahead from the last samples v0 (newest), v1 and v2
+// with a polynomial of the given order (0 holds, 1 is linear, 2 is quadratic)
+inline double predictVm(int order, double s, double v0, double v1, double v2)
+{
+    switch (order) {
+    case 2:
+        return v0 * (s + 1) * (s + 2) / 2 - v1 * s * (s + 2) + v2 * s * (s + 1) / 2;
+    case 1:
+        return v0 + s * (v0 - v1);
+    default:
+        return v0;
+    }
+}
+
+// Build a 0/5 V pulse train covering one trial of stimlength plus the wait between trials
+inline void fillLaserTTL(StimulusBuffer &laserStim, StimulusBuffer::storage_t storage, double dt,
+                         double laserDelay, double laserDuration, double laserNumPulses,
+                         double laserFreq, double stimlength, double delay)
+{
+    laserStim.reset(storage, 0, 5);
+    for (int i = 0; i < laserDelay / dt; i++) { // initial delay in trial before starting laser
+        laserStim.push_back(0);
+    }
+    for (int n = 0; n < laserNumPulses; n++) {
+        for (int i = 0; i < laserDuration / dt; i++) {
+            laserStim.push_back(5);
+        }
+        // fill in zeros for frequency
+        for (int i = 0; i < ((1 / laserFreq) - laserDuration) / dt; i++) {
+            laserStim.push_back(0);
+        }
+    }
+    double remainder = stimlength - (laserDelay + 1 / laserFreq * (laserNumPulses
+                                     - 1) + laserDuration);
+    for (int i = 0; i < remainder / dt; i++) { // pad the rest of the stimlength
+        laserStim.push_back(0);
+    }
+    for (int i = 0; i < delay / dt; i++) { // overall delay in trial
+        laserStim.push_back(0);
+    }
+}
+
+// Parse rows of four whitespace-separated values (current AMPA GABA NMDA) from the
+// length bytes at text, which need not be NUL-terminated, e.g. a memory-mapped file.
+// Numbers always use the C locale; nan and inf are accepted and left to validation.
+// Returns the number of bad rows: parsing stops at the first truncated or unreadable row.
+inline size_t parseStimulus(const char *text, size_t length, std::vector<double> &current,
+                            std::vector<double> &ampa, std::vector<double> &gaba,
+                            std::vector<double> &nmda)
+{
+    static locale_t clocale = newlocale(LC_NUMERIC_MASK, "C", (locale_t) 0);
+    const char *p = text, *stop = text + length;
+    std::string last; // token that runs to the end of the text, copied to terminate it
+    for (;;) {
+        while (p < stop && isspace((unsigned char) *p)) p++;
+        if (p == stop) return 0;
+        double value[4];
+        for (int c = 0; c < 4; c++) {
+            while (p < stop && isspace((unsigned char) *p)) p++;
+            const char *q = p;
+            while (q < stop && !isspace((unsigned char) *q)) q++;
+            char *end;
+            if (q < stop) { // the whitespace after the token stops strtod inside the text
+                value[c] = strtod_l(p, &end, clocale);
+            } else {
+                last.assign(p, q);
+                value[c] = strtod_l(last.c_str(), &end, clocale);
+                end = const_cast<char *> (p) + (end - last.c_str());
+            }
+            if (end == p) return 1;
+            p = end;
+        }
+        current.push_back(value[0]);
+        ampa.push_back(value[1]);
+        gaba.push_back(value[2]);
+        nmda.push_back(value[3]);
+    }
+}
+
+#endif
@@ -0,0 +1,172 @@
+/*
+ Copyright (C) 2011 Georgia Institute of Technology
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+ * Background conductance generator for the point-conductance model. Traces
+ * are either Ornstein-Uhlenbeck processes or shot noise (Poisson events with
+ * exponential decay) with a given mean, SD and time constant.
+ *
+ * Random numbers come from the Philox4x32-10 counter-based generator, keyed
+ * by the seed and indexed by (stream, sample), so any sample can be drawn
+ * independently. Both processes are the linear recursion y[k] = a y[k-1] + d[k],
+ * which is solved in fixed-size chunks: each chunk is first run from zero in
+ * parallel, the chunk end values are then carried forward in order, and the
+ * carries are finally added back in parallel. Chunk boundaries do not depend
+ * on the number of threads, so a trace is bit-reproducible from its seed.
+ */
+
+#ifndef G_WAVEFORM_NOISE_H
+#define G_WAVEFORM_NOISE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+struct NoiseParams {
+    enum kind_t { OU, SHOT };
+    kind_t kind;
+    double mean; // S
+    double sd; // S
+    double tau; // s
+};
+
+// Largest expected number of shot-noise events per sample. The Poisson inversion in
+// generateNoise() underflows at about 700 and stops at 1000 events.
+const double NOISE_MAX_EVENTS = 100;
+
+// Event amplitude and expected events per sample of shot noise decaying by a per sample.
+// They are matched to the sampled process, mean = amp rate / (1 - a) and
+// variance = amp^2 rate / (1 - a^2), so the moments do not depend on dt.
+inline double shotNoiseAmplitude(const NoiseParams &p, double dt)
+{
+    return (1 + exp(-dt / p.tau)) * p.sd * p.sd / p.mean;
+}
+
+inline double shotNoiseRate(const NoiseParams &p, double dt)
+{
+    return p.mean * (1 - exp(-dt / p.tau)) / shotNoiseAmplitude(p, dt);
+}
+
+// Philox4x32-10 (Salmon et al., SC'11) applied to counter ctr with key key
+inline void philox4x32(uint32_t ctr[4], uint32_t key0, uint32_t key1)
+{
+    for (int round = 0; round < 10; round++) {
+        uint64_t p0 = (uint64_t) 0xD2511F53u * ctr[0];
+        uint64_t p1 = (uint64_t) 0xCD9E8D57u * ctr[2];
+        uint32_t c0 = (uint32_t) (p1 >> 32) ^ ctr[1] ^ key0;
+        uint32_t c2 = (uint32_t) (p0 >> 32) ^ ctr[3] ^ key1;
+        ctr[0] = c0;
+        ctr[1] = (uint32_t) p1;
+        ctr[2] = c2;
+        ctr[3] = (uint32_t) p0;
+        key0 += 0x9E3779B9u;
+        key1 += 0xBB67AE85u;
+    }
+}
+
+// Two uniform deviates in (0, 1) for sample n of a stream
+inline void noiseUniforms(uint64_t seed, uint32_t stream, uint64_t n, double &u1, double &u2)
+{
+    uint32_t ctr[4] = { (uint32_t) n, (uint32_t) (n >> 32), stream, 0 };
+    philox4x32(ctr, (uint32_t) seed, (uint32_t) (seed >> 32));
+    uint64_t a = ((uint64_t) ctr[0] << 32 | ctr[1]) >> 11;
+    uint64_t b = ((uint64_t) ctr[2] << 32 | ctr[3]) >> 11;
+    u1 = (a + 0.5) / 9007199254740992.0; // 2^53
+    u2 = (b + 0.5) / 9007199254740992.0;
+}
+
+// Fill out with n samples of the process for one stream, using up to threads threads.
+inline void generateNoise(std::vector<double> &out, size_t n, double dt, const NoiseParams &p,
+                          uint64_t seed, uint32_t stream, unsigned threads)
+{
+    const size_t CHUNK = 65536; // fixed so results do not depend on threads
+    out.assign(n, 0);
+    if (n == 0) return;
+    const double a = exp(-dt / p.tau);
+    double b = 0, amp = 0, rate = 0;
+    if (p.kind == NoiseParams::OU) {
+        b = p.sd * sqrt(1 - a * a);
+    } else if (p.mean > 0 && p.sd > 0) {
+        amp = shotNoiseAmplitude(p, dt);
+        rate = shotNoiseRate(p, dt);
+    }
+
+    // drive d[k] of y[k] = a y[k-1] + d[k], with y = g - mean and y[-1] = 0
+    auto drive = [&](size_t k) -> double {
+        double u1, u2;
+        noiseUniforms(seed, stream, k, u1, u2);
+        if (p.kind == NoiseParams::OU) {
+            double z = sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+            return (k == 0 ? p.sd : b) * z; // start in the stationary distribution
+        }
+        if (k == 0 || rate <= 0) return 0; // start at the mean
+        int events = 0; // Poisson deviate by inversion
+        double prob = exp(-rate), cdf = prob;
+        while (u1 > cdf && events < 1000) {
+            events++;
+            prob *= rate / events;
+            cdf += prob;
+        }
+        return amp * events - p.mean * (1 - a);
+    };
+
+    const size_t chunks = (n + CHUNK - 1) / CHUNK;
+    auto parallel = [&](const std::function<void(size_t)> &body) {
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> pool;
+        auto worker = [&]() {
+            size_t c;
+            while ((c = next.fetch_add(1)) < chunks) body(c);
+        };
+        unsigned count = std::max(1u, std::min<unsigned>(threads, chunks));
+        for (unsigned t = 1; t < count; t++) pool.push_back(std::thread(worker));
+        worker();
+        for (size_t t = 0; t < pool.size(); t++) pool[t].join();
+    };
+
+    // run each chunk from zero
+    parallel([&](size_t c) {
+        double y = 0;
+        for (size_t k = c * CHUNK; k < std::min(n, (c + 1) * CHUNK); k++) {
+            y = a * y + drive(k);
+            out[k] = y;
+        }
+    });
+
+    // carry[c] is the true y just before chunk c
+    std::vector<double> carry(chunks, 0);
+    const double aChunk = pow(a, (double) CHUNK);
+    for (size_t c = 1; c < chunks; c++)
+        carry[c] = out[c * CHUNK - 1] + aChunk * carry[c - 1];
+
+    // add the decayed carry and the mean; the output is rectified at zero, the process is not
+    parallel([&](size_t c) {
+        double decay = a;
+        for (size_t k = c * CHUNK; k < std::min(n, (c + 1) * CHUNK); k++) {
+            out[k] = std::max(0.0, out[k] + decay * carry[c] + p.mean);
+            decay *= a;
+        }
+    });
+}
+
+#endif
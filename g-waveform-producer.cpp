@@ -0,0 +1,122 @@
+/*
+ Copyright (C) 2011 Georgia Institute of Technology
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+ * Reference producer for the Gwaveform shared-memory stream. It creates the
+ * ring buffer described in g-waveform-shm.h and fills it with sinusoidally
+ * modulated AMPA and GABA conductances, staying a fixed number of frames
+ * ahead of the module. It is meant for testing the stream input and as a
+ * template for model-driven producers. Build with:
+ *
+ *   g++ -O2 -std=c++11 -o g-waveform-producer g-waveform-producer.cpp -lrt
+ *
+ * Usage: g-waveform-producer [name] [period (us)] [trial frames] [capacity] [lead]
+ */
+
+#include "g-waveform-shm.h"
+
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int)
+{
+    running = 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *name = argc > 1 ? argv[1] : "/gwaveform";
+    double dt = (argc > 2 ? atof(argv[2]) : 100) * 1e-6; // s
+    uint32_t trialframes = argc > 3 ? atoi(argv[3]) : 1.0 / dt; // 1 s
+    uint32_t capacity = argc > 4 ? atoi(argv[4]) : 4096;
+    uint64_t lead = argc > 5 ? atoi(argv[5]) : 4; // frames written ahead of the module
+    if (lead < 1 || lead > capacity || trialframes < 1) {
+        fprintf(stderr, "Invalid arguments.\n");
+        return 1;
+    }
+
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        perror("shm_open");
+        return 1;
+    }
+    size_t size = gwaveformShmSize(capacity);
+    if (ftruncate(fd, size) < 0) {
+        perror("ftruncate");
+        shm_unlink(name);
+        return 1;
+    }
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        perror("mmap");
+        shm_unlink(name);
+        return 1;
+    }
+
+    // segment is zero filled, so every slot starts out empty
+    GwaveformShmHeader *header = new (addr) GwaveformShmHeader;
+    GwaveformShmFrame *frames = gwaveformShmFrames(header);
+    header->version = GWAVEFORM_SHM_VERSION;
+    header->capacity = capacity;
+    header->trialframes = trialframes;
+    header->writeseq.store(0);
+    header->readseq.store(0);
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = GWAVEFORM_SHM_MAGIC;
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    printf("Streaming to %s (%u slots, %u frames per trial). Press Ctrl-C to stop.\n",
+           name, capacity, trialframes);
+
+    uint64_t seq = 0;
+    struct timespec nap = { 0, 50000 };
+    while (running) {
+        if (seq >= header->readseq.load(std::memory_order_acquire) + lead) { // readseq may be ahead
+            nanosleep(&nap, NULL);
+            continue;
+        }
+        seq++;
+        double t = ((seq - 1) % trialframes) * dt;
+        GwaveformShmFrame &frame = frames[(seq - 1) % capacity];
+        frame.seq.store(GWAVEFORM_SHM_WRITING, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        frame.current = 0;
+        frame.ampa = 5e-9 * (1 + sin(2 * M_PI * 5 * t)); // S
+        frame.gaba = 10e-9 * (1 + cos(2 * M_PI * 5 * t));
+        frame.nmda = 0;
+        frame.seq.store(seq, std::memory_order_release);
+        header->writeseq.store(seq, std::memory_order_release);
+    }
+
+    printf("Wrote %llu frames, module consumed %llu.\n", (unsigned long long) seq,
+           (unsigned long long) header->readseq.load());
+    munmap(addr, size);
+    shm_unlink(name);
+    return 0;
+}
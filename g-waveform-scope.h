@@ -0,0 +1,123 @@
+/*
+ Copyright (C) 2011 Georgia Institute of Technology
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+ * Min/max decimator feeding the live scope. The real-time thread reduces every
+ * `factor` samples of each channel to one min/max bin and fills fixed-size
+ * blocks directly inside a single-producer single-consumer ring, so neither
+ * side allocates, locks or copies a block. When the GUI falls behind, new
+ * samples are dropped and counted instead of blocking the real-time thread.
+ * A partly filled block is thrown away when the GUI asks for it with discard()
+ * and when the tick goes backwards, so a block never mixes two runs.
+ */
+
+#ifndef G_WAVEFORM_SCOPE_H
+#define G_WAVEFORM_SCOPE_H
+
+#include <atomic>
+#include <stddef.h>
+
+struct ScopeBlock {
+    static const int CHANNELS = 6; // command, AMPA, GABA, NMDA, laser TTL, Vm
+    static const int BINS = 128;
+    long long start; // tick of the first sample in the block
+    int factor; // samples per bin
+    double min[CHANNELS][BINS];
+    double max[CHANNELS][BINS];
+};
+
+class ScopeDecimator
+{
+
+public:
+    static const size_t QUEUE = 16; // blocks
+
+    ScopeDecimator(void) : head(0), tail(0), dropped(0), factor(1), restart(false), bin(0), fill(0),
+        last(0), block(NULL) {}
+
+    // Samples per bin, applied from the next block. Call from any thread.
+    void setFactor(int n)
+    {
+        factor.store(n > 0 ? n : 1, std::memory_order_relaxed);
+    }
+
+    // Drop the block being filled on the next push. Call from any thread.
+    void discard(void)
+    {
+        restart.store(true, std::memory_order_release);
+    }
+
+    // Real-time side: add one sample of every channel taken at the given tick.
+    void push(const double x[ScopeBlock::CHANNELS], long long tick)
+    {
+        if (restart.exchange(false, std::memory_order_acquire) || tick < last) block = NULL;
+        last = tick;
+        if (!block) { // open the next free slot
+            if (head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire) >= QUEUE) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            block = &ring[head.load(std::memory_order_relaxed) % QUEUE];
+            block->start = tick;
+            block->factor = factor.load(std::memory_order_relaxed);
+            bin = 0;
+            fill = 0;
+        }
+        for (int c = 0; c < ScopeBlock::CHANNELS; c++) {
+            if (fill == 0 || x[c] < block->min[c][bin]) block->min[c][bin] = x[c];
+            if (fill == 0 || x[c] > block->max[c][bin]) block->max[c][bin] = x[c];
+        }
+        if (++fill < block->factor) return;
+        fill = 0;
+        if (++bin < ScopeBlock::BINS) return;
+        block = NULL;
+        head.fetch_add(1, std::memory_order_release); // publish the block
+    }
+
+    // GUI side: oldest complete block, or NULL. Call release() when done with it.
+    const ScopeBlock *front(void) const
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (head.load(std::memory_order_acquire) == t) return NULL;
+        return &ring[t % QUEUE];
+    }
+
+    void release(void)
+    {
+        tail.fetch_add(1, std::memory_order_release);
+    }
+
+    unsigned long droppedSamples(void) const
+    {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<size_t> head; // blocks published by the real-time thread
+    std::atomic<size_t> tail; // blocks consumed by the GUI
+    std::atomic<unsigned long> dropped; // samples lost while the ring was full
+    std::atomic<int> factor;
+    std::atomic<bool> restart; // discard() requested
+    int bin; // real-time side only
+    int fill;
+    long long last; // tick of the previous sample
+    ScopeBlock *block;
+    ScopeBlock ring[QUEUE];
+};
+
+#endif
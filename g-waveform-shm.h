@@ -0,0 +1,82 @@
+/*
+ Copyright (C) 2011 Georgia Institute of Technology
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+ * Layout of the POSIX shared-memory ring buffer used to stream conductance
+ * frames from a local producer process into the Gwaveform module. This file
+ * is shared by the plugin and the reference producer (g-waveform-producer.cpp)
+ * and must not depend on RTXI or Qt.
+ *
+ * The producer owns the segment. It writes frame n (n = 1, 2, ...) into slot
+ * (n - 1) % capacity and publishes it by storing the slot sequence number
+ * and then writeseq. A producer trial is trialframes frames long and starts
+ * at frame k * trialframes + 1. The consumer reads sample i of its trial t
+ * from frame base + t * trialframes + i + 1, where base is a multiple of
+ * trialframes, without copying it out of the segment. A slot whose sequence
+ * number does not match the expected one has either not been written yet
+ * (underrun) or has already been overwritten (overrun); it is skipped, so
+ * frames stay aligned with trials. The consumer publishes the last frame it
+ * consumed or skipped in readseq so the producer can pace itself. readseq
+ * may be ahead of writeseq, after an underrun or when a run starts at base,
+ * so the producer must pace with seq >= readseq + lead rather than a
+ * difference. Version 1 producers did not, hence the version bump.
+ */
+
+#ifndef G_WAVEFORM_SHM_H
+#define G_WAVEFORM_SHM_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+#define GWAVEFORM_SHM_MAGIC 0x4d535747u // "GWSM"
+#define GWAVEFORM_SHM_VERSION 2u
+#define GWAVEFORM_SHM_WRITING UINT64_MAX // slot is being rewritten
+
+struct GwaveformShmFrame {
+    std::atomic<uint64_t> seq; // sequence number of the frame in this slot, 0 if never written
+    double current; // absolute current (A)
+    double ampa; // conductances (S)
+    double gaba;
+    double nmda;
+};
+
+struct GwaveformShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity; // number of frame slots following the header
+    uint32_t trialframes; // frames per trial, sets the trial length in the module
+    alignas(64) std::atomic<uint64_t> writeseq; // last frame published by the producer
+    alignas(64) std::atomic<uint64_t> readseq; // last frame consumed by the module
+};
+
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t)
+              && ATOMIC_LLONG_LOCK_FREE == 2,
+              "shared-memory stream requires lock-free 64-bit atomics");
+
+inline size_t gwaveformShmSize(uint32_t capacity)
+{
+    return sizeof(GwaveformShmHeader) + capacity * sizeof(GwaveformShmFrame);
+}
+
+inline GwaveformShmFrame *gwaveformShmFrames(GwaveformShmHeader *header)
+{
+    return reinterpret_cast<GwaveformShmFrame *> (header + 1);
+}
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ Copyright (C) 2011 Georgia Institute of Technology
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+ * Single-pass summary of a stimulus channel, used to validate a stimulus
+ * before it is allowed to run. Min, max, mean and RMS cover finite samples
+ * only; non-finite and negative samples are counted separately.
+ */
+
+#ifndef G_WAVEFORM_STATS_H
+#define G_WAVEFORM_STATS_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stddef.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+struct ChannelStats {
+    double min;
+    double max;
+    double mean;
+    double rms;
+    size_t count; // all samples
+    size_t nonfinite;
+    size_t negative;
+};
+
+inline ChannelStats channelStats(const double *x, size_t n)
+{
+    double lo = std::numeric_limits<double>::infinity();
+    double hi = -lo;
+    double sum = 0, sumsq = 0;
+    size_t finite = 0, negative = 0;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d inf = _mm_set1_pd(std::numeric_limits<double>::infinity());
+    __m128d vlo = inf, vhi = _mm_sub_pd(zero, inf);
+    __m128d vsum = zero, vsumsq = zero;
+    __m128i vfinite = _mm_setzero_si128(), vnegative = _mm_setzero_si128();
+    for (; i + 2 <= n; i += 2) {
+        __m128d v = _mm_loadu_pd(x + i);
+        __m128d ok = _mm_cmpeq_pd(_mm_sub_pd(v, v), zero); // x - x is NaN for NaN and inf
+        __m128d vf = _mm_and_pd(ok, v);
+        vlo = _mm_min_pd(vlo, _mm_or_pd(vf, _mm_andnot_pd(ok, inf)));
+        vhi = _mm_max_pd(vhi, _mm_or_pd(vf, _mm_andnot_pd(ok, _mm_sub_pd(zero, inf))));
+        vsum = _mm_add_pd(vsum, vf);
+        vsumsq = _mm_add_pd(vsumsq, _mm_mul_pd(vf, vf));
+        // compare masks are all ones (-1) where true
+        vfinite = _mm_sub_epi64(vfinite, _mm_castpd_si128(ok));
+        vnegative = _mm_sub_epi64(vnegative, _mm_castpd_si128(_mm_cmplt_pd(v, zero)));
+    }
+    double l[2], h[2], s[2], q[2];
+    int64_t f[2], g[2];
+    _mm_storeu_pd(l, vlo);
+    _mm_storeu_pd(h, vhi);
+    _mm_storeu_pd(s, vsum);
+    _mm_storeu_pd(q, vsumsq);
+    _mm_storeu_si128(reinterpret_cast<__m128i *> (f), vfinite);
+    _mm_storeu_si128(reinterpret_cast<__m128i *> (g), vnegative);
+    lo = std::min(l[0], l[1]);
+    hi = std::max(h[0], h[1]);
+    sum = s[0] + s[1];
+    sumsq = q[0] + q[1];
+    finite = f[0] + f[1];
+    negative = g[0] + g[1];
+#endif
+
+    for (; i < n; i++) {
+        if (std::isfinite(x[i])) {
+            lo = std::min(lo, x[i]);
+            hi = std::max(hi, x[i]);
+            sum += x[i];
+            sumsq += x[i] * x[i];
+            finite++;
+        }
+        if (x[i] < 0) negative++;
+    }
+
+    ChannelStats stats;
+    stats.count = n;
+    stats.nonfinite = n - finite;
+    stats.negative = negative;
+    stats.min = finite ? lo : 0;
+    stats.max = finite ? hi : 0;
+    stats.mean = finite ? sum / finite : 0;
+    stats.rms = finite ? std::sqrt(sumsq / finite) : 0;
+    return stats;
+}
+
+#endif
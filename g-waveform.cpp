@@ -25,6 +25,19 @@
  * If you change the real-time period, the length of the trial is recomputed. This
  * module automatically pauses itself when the protocol is complete.
  *
+ * When a file is loaded, per-channel statistics and the estimated peak current at -65 mV
+ * are shown in the module. The protocol cannot be started if the file has truncated or
+ * unreadable rows, non-finite values, or negative conductances.
+ *
+ * Instead of a file, Ornstein-Uhlenbeck or shot-noise AMPA and GABA conductances can be
+ * generated from the "Noise" parameters (see g-waveform-noise.h). Every trial gets fresh
+ * noise that can be regenerated exactly from "Noise Seed". Only the running trial and the
+ * next one are held in memory.
+ *
+ * The loaded stimulus can be held in memory as 64-bit samples or as 32-bit or 16-bit
+ * fixed-point samples with a per-channel scale and offset (see g-waveform-buffer.h).
+ * A channel whose quantization error exceeds 0.01% of its peak value is kept at 64 bits.
+ *
  * If you are using the Data Recorder, be sure to open the Data Recorder AFTER you open
  * this module or RTXI will crash. This module increments the trial number in the Data
  * Recorder so that each trial will be a separate structure in the HDF5 file. If you do
@@ -45,11 +58,34 @@
  * the "Ihold ID" field. You will probably want to manually start the external Ihold
  * module first. When this dynamic clamp module unpauses, it will pause the
  * Ihold module, and vice versa.
+ *
+ * To compensate the one-sample loop delay, check "Predict Vm" to compute the driving force
+ * from Vm extrapolated over "Prediction Latency (ms)" with a linear or quadratic fit to the
+ * last samples. The prediction error against the measured Vm is shown as states.
+ *
+ * "Scope" shows the outputs and Vm live as min/max envelopes decimated in the real-time
+ * loop to about 1000 bins/s.
+ *
+ * When "Average" is checked, a running mean and variance of Vm and the output currents
+ * across trials is kept for every sample. "Trial Average" plots it live, and it is saved
+ * to <data file>-average.dat when the protocol completes.
+ *
+ * Instead of a file, conductances can be streamed from a local producer process through
+ * a POSIX shared-memory ring buffer (see g-waveform-shm.h). Enter the segment name in the
+ * "Stream Name" field and check "Shared Memory". The producer sets the number of frames per
+ * trial. If no frame is available on a tick, the holding current is injected and the tick
+ * is counted in "Stream Underruns".
  */
 
 #include <g-waveform.h>
 #include <basicplot.h>
 #include <main_window.h>
+#include <qwt_plot.h>
+#include <qwt_plot_curve.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 extern "C" Plugin::Object *createRTXIPlugin(void)
 {
@@ -146,6 +182,67 @@ vars[] = {
         | DefaultGUIModel::DOUBLE,
     },
     { "Time (s)", "Time (s)", DefaultGUIModel::STATE, },
+    {
+        "Stream Name",
+        "Name of the POSIX shared-memory segment written by the stimulus producer",
+        DefaultGUIModel::COMMENT
+    },
+    {
+        "Stream Underruns", "Ticks on which no stream frame was available",
+        DefaultGUIModel::STATE,
+    },
+    {
+        "Stream Overruns", "Stream frames overwritten before they were read",
+        DefaultGUIModel::STATE,
+    },
+    {
+        "Prediction Latency (ms)", "Time over which Vm is extrapolated to compensate the loop delay",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE,
+    },
+    {
+        "Vm Pred. RMS Error (mV)", "RMS difference between predicted and measured Vm",
+        DefaultGUIModel::STATE,
+    },
+    {
+        "Vm Pred. Max Error (mV)", "Largest difference between predicted and measured Vm",
+        DefaultGUIModel::STATE,
+    },
+    {
+        "Noise AMPA Mean (nS)", "Mean of the generated AMPA conductance",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE,
+    },
+    {
+        "Noise AMPA SD (nS)", "Standard deviation of the generated AMPA conductance",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE,
+    },
+    {
+        "Noise AMPA Tau (ms)", "Time constant of the generated AMPA conductance",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE,
+    },
+    {
+        "Noise GABA Mean (nS)", "Mean of the generated GABA conductance",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE,
+    },
+    {
+        "Noise GABA SD (nS)", "Standard deviation of the generated GABA conductance",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE,
+    },
+    {
+        "Noise GABA Tau (ms)", "Time constant of the generated GABA conductance",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE,
+    },
+    {
+        "Noise Length (s)", "Length of each trial of generated conductances",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE,
+    },
+    {
+        "Noise Seed", "Seed of the generated conductances, trial k uses streams 2k (AMPA) and 2k + 1 (GABA) of the seed",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::UINTEGER,
+    },
+    {
+        "Noise Underruns", "Ticks on which the generated noise of the trial was not ready",
+        DefaultGUIModel::STATE,
+    },
 };
 
 static size_t num_vars = sizeof(vars) / sizeof(DefaultGUIModel::variable_t);
@@ -157,6 +254,10 @@ Gwaveform::Gwaveform(void) : DefaultGUIModel("Gwaveform", ::vars, ::num_vars)
     initParameters();
     update( INIT );
     refresh();
+    noiseThread = std::thread(&Gwaveform::runNoiseThread, this);
+    pollTimer = new QTimer(this);
+    QObject::connect(pollTimer, SIGNAL(timeout()), this, SLOT(pollProtocol()));
+    pollTimer->start(50);
     QTimer::singleShot(0, this, SLOT(resizeMe()));
 }
 
@@ -186,7 +287,12 @@ void Gwaveform::customizeGUI(void)
         " checkbox, you must provide the instance ID of the correct holding current module in"
         " the 'Ihold ID' field. You will probably want to manually start the external Ihold"
         " module first. When this dynamic clamp module unpauses, it will pause the"
-        " Ihold module, and vice versa."
+        " Ihold module, and vice versa.<br><br>"
+        " Instead of a file, conductances can be streamed from a local producer process through"
+        " a POSIX shared-memory ring buffer. Enter the segment name in the 'Stream Name' field"
+        " and check 'Shared Memory'. The producer sets the number of frames per trial. If no"
+        " frame is available on a tick, the holding current is injected and the tick is counted"
+        " in 'Stream Underruns'."
         "</p>");
 
     QGridLayout *customLayout = DefaultGUIModel::getLayout();
@@ -199,12 +305,29 @@ void Gwaveform::customizeGUI(void)
     QButtonGroup *fileButtons = new QButtonGroup;
     QPushButton *loadBttn = new QPushButton("Load File");
     QPushButton *previewBttn = new QPushButton("Preview File");
+    QPushButton *scopeBttn = new QPushButton("Scope");
+    scopeBttn->setToolTip("Show the commanded outputs and Vm while the protocol runs");
     fileBoxLayout->addWidget(loadBttn);
     fileBoxLayout->addWidget(previewBttn);
+    fileBoxLayout->addWidget(scopeBttn);
     fileButtons->addButton(loadBttn);
     fileButtons->addButton(previewBttn);
+    fileButtons->addButton(scopeBttn);
+    QObject::connect(scopeBttn, SIGNAL(clicked()), this, SLOT(showScope()));
     QObject::connect(loadBttn, SIGNAL(clicked()), this, SLOT(loadFile()));
     QObject::connect(previewBttn, SIGNAL(clicked()), this, SLOT(previewFile()));
+    streamCheckBox = new QCheckBox("Shared Memory");
+    streamCheckBox->setToolTip("Read conductances from the shared-memory stream instead of the file");
+    fileBoxLayout->addWidget(streamCheckBox);
+    streamCheckBox->setChecked(false);
+    QObject::connect(streamCheckBox, SIGNAL(toggled(bool)), this, SLOT(toggleStream(bool)));
+    storageComboBox = new QComboBox;
+    storageComboBox->setToolTip("Sample format used to hold the loaded stimulus in memory");
+    storageComboBox->addItem("64-bit");
+    storageComboBox->addItem("32-bit fixed");
+    storageComboBox->addItem("16-bit fixed");
+    fileBoxLayout->addWidget(storageComboBox);
+    QObject::connect(storageComboBox, SIGNAL(activated(int)), this, SLOT(setStorage(int)));
 
     QGroupBox *optionRow1 = new QGroupBox("Active Conductances");
     QHBoxLayout *optionRow1Layout = new QHBoxLayout;
@@ -245,17 +368,64 @@ void Gwaveform::customizeGUI(void)
     QObject::connect(laserCheckBox, SIGNAL(toggled(bool)), this, SLOT(toggleLaserTTL(bool)));
     QObject::connect(IholdCheckBox, SIGNAL(toggled(bool)), this, SLOT(toggleIhold(bool)));
 
+    QGroupBox *optionRow4 = new QGroupBox("Loop Delay Compensation");
+    QHBoxLayout *optionRow4Layout = new QHBoxLayout;
+    optionRow4->setLayout(optionRow4Layout);
+    optionRow4->setToolTip("Extrapolate Vm over the prediction latency before computing the driving force");
+    QCheckBox *predCheckBox = new QCheckBox("Predict Vm");
+    predComboBox = new QComboBox;
+    predComboBox->addItem("Linear");
+    predComboBox->addItem("Quadratic");
+    optionRow4Layout->addWidget(predCheckBox);
+    optionRow4Layout->addWidget(predComboBox);
+    predCheckBox->setChecked(false); // set some defaults
+    predComboBox->setCurrentIndex(0);
+    QObject::connect(predCheckBox, SIGNAL(toggled(bool)), this, SLOT(togglePrediction(bool)));
+    QObject::connect(predComboBox, SIGNAL(activated(int)), this, SLOT(setPredictionOrder(int)));
+
+    QGroupBox *noiseBox = new QGroupBox("Background Noise");
+    QHBoxLayout *noiseBoxLayout = new QHBoxLayout;
+    noiseBox->setLayout(noiseBoxLayout);
+    noiseBox->setToolTip("Generate AMPA and GABA conductances from the noise parameters instead of a file");
+    noiseComboBox = new QComboBox;
+    noiseComboBox->addItem("Ornstein-Uhlenbeck");
+    noiseComboBox->addItem("Shot Noise");
+    QPushButton *noiseBttn = new QPushButton("Generate");
+    noiseBoxLayout->addWidget(noiseComboBox);
+    noiseBoxLayout->addWidget(noiseBttn);
+    QObject::connect(noiseComboBox, SIGNAL(activated(int)), this, SLOT(setNoiseKind(int)));
+    QObject::connect(noiseBttn, SIGNAL(clicked()), this, SLOT(makeNoise()));
+    QObject::connect(DefaultGUIModel::pauseButton, SIGNAL(toggled(bool)), noiseBttn, SLOT(setEnabled(bool)));
+
+    QGroupBox *statsBox = new QGroupBox("Stimulus Statistics");
+    QHBoxLayout *statsBoxLayout = new QHBoxLayout;
+    statsBox->setLayout(statsBoxLayout);
+    statsBox->setToolTip("Statistics of the loaded stimulus, checked before the protocol can start");
+    statsLabel = new QLabel("No file loaded.");
+    statsBoxLayout->addWidget(statsLabel);
+
     QGroupBox *optionRow3 = new QGroupBox("Data Recorder");
     QHBoxLayout *optionRow3Layout = new QHBoxLayout;
     optionRow3->setLayout(optionRow3Layout);
     optionRow3->setToolTip("Select whether to sync with the data recorder");
     QCheckBox *recordCheckBox = new QCheckBox("Sync Data");
+    QCheckBox *avgCheckBox = new QCheckBox("Average");
+    avgCheckBox->setToolTip("Keep a running average of Vm and currents across trials and save it when the protocol completes");
+    QPushButton *avgBttn = new QPushButton("Trial Average");
+    avgBttn->setToolTip("Show the running average of Vm and currents across trials");
     optionRow3Layout->addWidget(recordCheckBox);
+    optionRow3Layout->addWidget(avgCheckBox);
+    optionRow3Layout->addWidget(avgBttn);
+    QObject::connect(avgCheckBox, SIGNAL(toggled(bool)), this, SLOT(toggleAverage(bool)));
+    QObject::connect(DefaultGUIModel::pauseButton, SIGNAL(toggled(bool)), avgCheckBox, SLOT(setEnabled(bool)));
+    QObject::connect(avgBttn, SIGNAL(clicked()), this, SLOT(showAverage()));
     recordCheckBox->setChecked(true); // set some defaults
     recordCheckBox->setEnabled(true);
     QObject::connect(recordCheckBox, SIGNAL(toggled(bool)), this, SLOT(toggleRecord(bool)));
 
     QObject::connect(DefaultGUIModel::pauseButton, SIGNAL(toggled(bool)), DefaultGUIModel::modifyButton, SLOT(setEnabled(bool)));
+    QObject::connect(DefaultGUIModel::pauseButton, SIGNAL(toggled(bool)), streamCheckBox, SLOT(setEnabled(bool)));
+    QObject::connect(DefaultGUIModel::pauseButton, SIGNAL(toggled(bool)), storageComboBox, SLOT(setEnabled(bool)));
     DefaultGUIModel::pauseButton->setToolTip("Start/Stop dynamic clamp protocol");
     DefaultGUIModel::modifyButton->setToolTip("Commit changes to parameter values");
     DefaultGUIModel::unloadButton->setToolTip("Close plugin");
@@ -267,57 +437,76 @@ void Gwaveform::customizeGUI(void)
     customLayout->addWidget(optionRow1, 2, 0);
     customLayout->addWidget(optionRow2, 3, 0);
     customLayout->addWidget(optionRow3, 4, 0);
+    customLayout->addWidget(optionRow4, 5, 0);
+    customLayout->addWidget(noiseBox, 6, 0);
+    customLayout->addWidget(statsBox, 7, 0);
 
     setLayout(customLayout);
 }
 
-Gwaveform::~Gwaveform(void) {}
+Gwaveform::~Gwaveform(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(noiseMutex);
+        noisequit = true;
+    }
+    noiseWake.notify_one();
+    noiseThread.join();
+    detachStream();
+    scopeon = false;
+    delete avgWindow;
+    delete scopeWindow;
+}
 
 void Gwaveform::execute(void)
 {
     Vm = input(0); // input is in V
+    double Iwave = 0, gAMPA = 0, gGABA = 0, gNMDA = 0; // stimulus values for this tick
+    double Vp = compensateVm(); // Vm at which the current will be applied
+    if (predicton == false) Vp = Vm;
     systime = count * dt; // module running time, s
 
     if (trial < maxtrials) { // run trial
         if (trialtimecount * dt < delay) {
             output(0) = Ihold;
         } else {
-            if (clampon == true) { // determine injected current
-                if (ampaon == true) {
-                    output(1) = -1 * AMPAwave[idx] * (Vm - AMPArev) * AMPAgain;
-                } else {
-                    output(1) = 0;
-                }
-                if (gabaon == true) {
-                    output(2) = -1 * GABAwave[idx] * (Vm - GABArev) * GABAgain;
-                } else {
-                    output(2) = 0;
-                }
-                if (nmdaon == true) {
-                    output(3) = -1 * NMDAwave[idx] * (Vm - NMDArev) * 1 / (1 + P1
-                                * exp(-P2 * Vm)) * NMDAgain;
-                } else {
-                    output(3) = 0;
-                }
-                output(0) = output(1) + output(2) + output(3);
-                if (currenton == true) {
-                    output(0) = output(0) + currentwave[idx];
-                }
-            } else if (clampon == false) {
-                output(1) = 0;
-                output(2) = 0;
-                output(3) = 0;
-                output(0) = 0;
+            bool starved = false;
+            if (clampon == true && streamon == true) {
+                // frames stay aligned with trials; past the producer's trial the stimulus is zero
+                if (static_cast<uint32_t> (idx) < streamframes)
+                    starved = !readStream(streambase + (uint64_t) trial * streamframes + idx + 1,
+                                          Iwave, gAMPA, gGABA, gNMDA);
+            } else if (clampon == true) {
+                // generated noise alternates between two trial slots
+                starved = noiseon == true && noiseready.load(std::memory_order_acquire) < trial;
+                if (starved) noiseUnderruns++;
             }
-
-            if (laserTTLon == true) { // determine TTL stimulus
-                output(4) = laserStim[idx];
-            } else if (laserTTLon == false) {
-                output(4) = 0;
+            if (clampon == true && streamon == false && !starved) {
+                size_t j = (trial % 2) * stimstride + idx;
+                Iwave = currentwave[j];
+                gAMPA = AMPAwave[j];
+                gGABA = GABAwave[j];
+                gNMDA = NMDAwave[j];
             }
+            const ClampSettings clamp = { currenton, ampaon, gabaon, nmdaon, clampon, laserTTLon,
+                                          AMPArev, AMPAgain, GABArev, GABAgain, NMDArev, NMDAgain,
+                                          P1, P2
+                                        };
+            double out[5]; // determine injected current and TTL stimulus
+            clampOutputs(clamp, Vp, Iwave, gAMPA, gGABA, gNMDA,
+                         laserTTLon == true ? laserStim[idx] : 0, out);
+            if (starved) { // producer or noise generation starved, fall back to holding current
+                out[1] = 0;
+                out[2] = 0;
+                out[3] = 0;
+                out[0] = Ihold;
+            }
+            for (int k = 0; k < 5; k++) output(k) = out[k];
 
-            if (laserTTLon == true or clampon == true)
+            if (laserTTLon == true or clampon == true) {
+                if (!starved) accumulateAverage(); // keep the fallback current out of the average
                 idx++;
+            }
         } // end single trial
 
     } else { // all trials are done, send signal to holding current module, and pause
@@ -326,6 +515,11 @@ void Gwaveform::execute(void)
         pause(true);
     } // end protocol
 
+    if (scopeon.load(std::memory_order_relaxed)) {
+        double x[ScopeBlock::CHANNELS] = { output(0), output(1), output(2), output(3), output(4), Vm };
+        scope.push(x, count);
+    }
+
     count++; // increment count to measure total module running time
     trialtimecount++; // increment count to measure time within single trial
 
@@ -335,6 +529,7 @@ void Gwaveform::execute(void)
         trialtimecount = 0;
         idx = 0;
         if (recordon) DataRecorder::startRecording();
+        trialstarted.store(trial, std::memory_order_release); // frees the slot of the last trial
     }
 }
 
@@ -363,13 +558,30 @@ void Gwaveform::update(Gwaveform::update_flags_t flag)
         setParameter("Laser TTL Freq (Hz)", QString::number(laserFreq)); // initially 1
         setParameter("Laser TTL Delay (s)", QString::number(laserDelay)); // initially 1
         setState("Time (s)", systime);
+        setComment("Stream Name", shmName);
+        setParameter("Prediction Latency (ms)", QString::number(predlatency * 1000)); // convert from s to ms
+        setState("Vm Pred. RMS Error (mV)", predRMSerr);
+        setState("Vm Pred. Max Error (mV)", predMaxErr);
+        setParameter("Noise AMPA Mean (nS)", QString::number(noiseAMPA.mean * 1e9)); // convert from S to nS
+        setParameter("Noise AMPA SD (nS)", QString::number(noiseAMPA.sd * 1e9));
+        setParameter("Noise AMPA Tau (ms)", QString::number(noiseAMPA.tau * 1000)); // convert from s to ms
+        setParameter("Noise GABA Mean (nS)", QString::number(noiseGABA.mean * 1e9));
+        setParameter("Noise GABA SD (nS)", QString::number(noiseGABA.sd * 1e9));
+        setParameter("Noise GABA Tau (ms)", QString::number(noiseGABA.tau * 1000));
+        setParameter("Noise Length (s)", QString::number(noiselength));
+        setParameter("Noise Seed", QString::number(noiseseed));
+        setState("Stream Underruns", streamUnderruns);
+        setState("Stream Overruns", streamOverruns);
+        setState("Noise Underruns", noiseUnderruns);
         DataRecorder::openFile(dFile);
 
         break;
     case MODIFY:
         gFile = getComment("Stimulus File Name");
+        if (noiseon && gFile != noiseComment()) stopNoise(); // a file name was entered
         dFile = getComment("Data File Name");
         userComment = getComment("Comment");
+        shmName = getComment("Stream Name");
         printf("Saving to new file: %s\n", dFile.toStdString().data());
         DataRecorder::openFile(dFile);
         IholdID = getParameter("Ihold ID").toInt();
@@ -392,6 +604,21 @@ void Gwaveform::update(Gwaveform::update_flags_t flag)
         delay = getParameter("Wait time (s)").toDouble();
         Ihold = getParameter("Holding Current (pA)").toDouble() * 1e-12; // convert from pA to A
         maxtrials = getParameter("Repeat").toDouble();
+        predlatency = getParameter("Prediction Latency (ms)").toDouble() / 1000; // convert from ms to s
+        if (predlatency < 0 || predlatency >= (PRED_BUFFER - 2) * dt) {
+            QMessageBox::critical(this, "Dynamic Clamp", tr(
+                                      "The prediction latency must be between 0 and %1 ms.\n").arg((PRED_BUFFER - 2) * dt * 1000));
+            predlatency = dt;
+            setParameter("Prediction Latency (ms)", QString::number(predlatency * 1000));
+        }
+        noiseAMPA.mean = getParameter("Noise AMPA Mean (nS)").toDouble() * 1e-9; // convert from nS to S
+        noiseAMPA.sd = getParameter("Noise AMPA SD (nS)").toDouble() * 1e-9;
+        noiseAMPA.tau = getParameter("Noise AMPA Tau (ms)").toDouble() / 1000; // convert from ms to s
+        noiseGABA.mean = getParameter("Noise GABA Mean (nS)").toDouble() * 1e-9;
+        noiseGABA.sd = getParameter("Noise GABA SD (nS)").toDouble() * 1e-9;
+        noiseGABA.tau = getParameter("Noise GABA Tau (ms)").toDouble() / 1000;
+        noiselength = getParameter("Noise Length (s)").toDouble();
+        noiseseed = getParameter("Noise Seed").toULongLong();
         bookkeep();
         if (getParameter("Laser TTL Duration (s)").toDouble() >= (getParameter(
                     "Laser TTL Freq (Hz)").toDouble())) {
@@ -413,12 +640,20 @@ void Gwaveform::update(Gwaveform::update_flags_t flag)
             laserDelay = getParameter("Laser TTL Delay (s)").toDouble();
             makeLaserTTL();
         }
-        loadFile(gFile);
+        if (streamon) {
+            attachStream(shmName);
+        } else if (noiseon) {
+            makeNoise();
+        } else {
+            loadFile(gFile);
+        }
 
         break;
     case PAUSE:
         output(0) = 0; // stop command in case pause occurs in the middle of command
         printf("Protocol paused.\n");
+        // may run on the real-time thread, so only flag the save for pollProtocol()
+        if (trial >= maxtrials) avgdone.store(true, std::memory_order_release);
         if (Iholdon) {
             IholdModule->setActive(true);
             IholdModule->refresh();
@@ -426,6 +661,7 @@ void Gwaveform::update(Gwaveform::update_flags_t flag)
         break;
     case UNPAUSE:
         bookkeep();
+        if (noiseon) rewindNoise();
         output(5) = 1;
         if (recordon) DataRecorder::startRecording();
         printf("Starting protocol.\n");
@@ -437,8 +673,16 @@ void Gwaveform::update(Gwaveform::update_flags_t flag)
     case PERIOD:
         dt = RT::System::getInstance()->getPeriod() * 1e-9;
         printf("New real-time period: %f\n", dt);
-        stimlength = GABAwave.size() * dt;
-        loadFile(gFile);
+        scope.setFactor(lround(1e-3 / dt));
+        if (streamon) {
+            stimlength = streamframes * dt;
+            setState("Length (s)", stimlength);
+        } else if (noiseon) {
+            makeNoise();
+        } else {
+            stimlength = GABAwave.size() * dt;
+            loadFile(gFile);
+        }
     default:
         break;
     }
@@ -477,6 +721,45 @@ void Gwaveform::initParameters()
     IholdID = 0;
     Iholdon = false;
     recordon = true;
+    streamon = false;
+    storage = StimulusBuffer::DOUBLE;
+    predicton = false;
+    predorder = 1;
+    predlatency = dt; // one period
+    avgon = false;
+    avglength = 0;
+    avgsamples = 0;
+    avgdone = false;
+    avgWindow = NULL;
+    scopeon = false;
+    scopeWindow = NULL;
+    scope.setFactor(lround(1e-3 / dt)); // about 1000 bins/s
+    badrows = 0;
+    for (int i = 0; i < 4; i++) stimstats[i] = channelStats(NULL, 0);
+    stimstride = 0;
+    noiseon = false;
+    noisesamples = 0;
+    noiseready = -1;
+    noiseUnderruns = 0;
+    trialstarted = 0;
+    noiserequest = -1;
+    noisequit = false;
+    noiseAMPA.kind = NoiseParams::OU; // point-conductance model of Destexhe et al. (2001)
+    noiseAMPA.mean = 12e-9; // S
+    noiseAMPA.sd = 3e-9; // S
+    noiseAMPA.tau = 2.7e-3; // s
+    noiseGABA.kind = NoiseParams::OU;
+    noiseGABA.mean = 57e-9; // S
+    noiseGABA.sd = 6.6e-9; // S
+    noiseGABA.tau = 10.5e-3; // s
+    noiselength = 10; // s
+    noiseseed = 1;
+    shmName = "/gwaveform";
+    shmHeader = NULL;
+    shmFrames = NULL;
+    shmSize = 0;
+    shmCapacity = 0;
+    streamframes = 0;
     ready = false;
     pauseButton->setEnabled(ready);
     bookkeep();
@@ -490,7 +773,28 @@ void Gwaveform::bookkeep()
     trialtimecount = 0;
     systime = 0;
     idx = 0;
+    trialstarted = 0;
     triallength = stimlength + delay;
+    streamUnderruns = 0;
+    streamOverruns = 0;
+    noiseUnderruns = 0;
+    nhist = 0;
+    prederrsum = 0;
+    prederrn = 0;
+    predRMSerr = 0;
+    predMaxErr = 0;
+    streambase = 0;
+    if (shmHeader && streamframes > 0) {
+        // start at the first producer trial after the last consumed frame and the
+        // oldest one still in the ring, and let the producer skip ahead to it
+        uint64_t head = shmHeader->writeseq.load(std::memory_order_acquire);
+        uint64_t next = shmHeader->readseq.load(std::memory_order_acquire) + 1;
+        if (head >= shmCapacity && next < head - shmCapacity + 1)
+            next = head - shmCapacity + 1;
+        streambase = (next - 1 + streamframes - 1) / streamframes * streamframes;
+        if (streambase > shmHeader->readseq.load(std::memory_order_relaxed))
+            shmHeader->readseq.store(streambase, std::memory_order_release);
+    }
 }
 
 void Gwaveform::toggleCurrent(bool on)
@@ -533,29 +837,445 @@ void Gwaveform::toggleRecord(bool on)
     recordon = on;
 }
 
-void Gwaveform::makeLaserTTL()
+void Gwaveform::toggleStream(bool on)
+{
+    if (on) {
+        shmName = getComment("Stream Name");
+        streamon = attachStream(shmName);
+        if (!streamon) streamCheckBox->setChecked(false);
+    } else if (streamon) {
+        detachStream();
+        streamon = false;
+        if (noiseon) makeNoise();
+        else loadFile(gFile);
+    }
+}
+
+void Gwaveform::setStorage(int index)
+{
+    switch (index) {
+    case 1:
+        storage = StimulusBuffer::FIXED32;
+        break;
+    case 2:
+        storage = StimulusBuffer::FIXED16;
+        break;
+    default:
+        storage = StimulusBuffer::DOUBLE;
+        break;
+    }
+    makeLaserTTL();
+    if (streamon) return;
+    if (noiseon) makeNoise();
+    else loadFile(gFile);
+}
+
+void Gwaveform::togglePrediction(bool on)
+{
+    predicton = on;
+}
+
+void Gwaveform::setPredictionOrder(int index)
+{
+    predorder = index + 1;
+}
+
+// Called from execute(): extrapolates Vm over the prediction latency and scores the
+// prediction made one latency ago against Vm interpolated between the last two samples.
+double Gwaveform::compensateVm()
+{
+    Vhist[2] = Vhist[1];
+    Vhist[1] = Vhist[0];
+    Vhist[0] = Vm;
+    if (nhist < 3) nhist++;
+
+    double s = predlatency / dt; // latency in sample periods
+    int k = static_cast<int>(s);
+    if (count > k && k + 1 < PRED_BUFFER) {
+        double measured = Vhist[1] + (s - k) * (Vhist[0] - Vhist[1]);
+        double error = fabs(predbuf[(count - k - 1) % PRED_BUFFER] - measured) * 1000; // mV
+        prederrsum += error * error;
+        prederrn++;
+        predRMSerr = sqrt(prederrsum / prederrn);
+        if (error > predMaxErr) predMaxErr = error;
+    }
+
+    double Vp = predictVm(std::min(predorder, nhist - 1), s, Vhist[0], Vhist[1], Vhist[2]);
+    predbuf[count % PRED_BUFFER] = Vp;
+    return Vp;
+}
+
+// Set the trial length to n samples and allocate its records if averaging is on.
+// Only called while paused.
+void Gwaveform::resizeAverage(size_t n)
+{
+    avglength = n;
+    avgsamples = 0;
+    std::vector<AverageRecord>(avgon ? n : 0).swap(avg); // value-initialized to zero
+    avgsamples = avg.size();
+}
+
+// Called from execute(): Welford update of the running mean and variance at idx.
+void Gwaveform::accumulateAverage()
+{
+    if (idx < 0 || static_cast<size_t> (idx) >= avgsamples) return;
+    double x[AVG_CHANNELS] = { Vm, output(0), output(1), output(2), output(3) };
+    AverageRecord &r = avg[idx];
+    int n = trial == 0 ? 1 : r.count.load(std::memory_order_relaxed) + 1;
+    for (int c = 0; c < AVG_CHANNELS; c++) {
+        double mean = 0, m2 = 0;
+        if (n > 1) {
+            mean = r.channel[c].mean.load(std::memory_order_relaxed);
+            m2 = r.channel[c].m2.load(std::memory_order_relaxed);
+        }
+        double delta = x[c] - mean;
+        mean += delta / n;
+        m2 += delta * (x[c] - mean);
+        r.channel[c].mean.store(mean, std::memory_order_relaxed);
+        r.channel[c].m2.store(m2, std::memory_order_relaxed);
+    }
+    r.count.store(n, std::memory_order_release);
+}
+
+// Averaging can only be switched while paused; the records exist only while it is on.
+void Gwaveform::toggleAverage(bool on)
+{
+    avgon = on;
+    resizeAverage(avglength);
+}
+
+void Gwaveform::showAverage()
+{
+    if (!avgWindow) {
+        avgWindow = new QWidget;
+        avgWindow->setWindowTitle("Trial Average");
+        QVBoxLayout *layout = new QVBoxLayout(avgWindow);
+        avgLabel = new QLabel("No trials averaged.");
+        avgVmPlot = new QwtPlot;
+        avgVmPlot->setAxisTitle(QwtPlot::yLeft, "Vm (mV)");
+        avgVmPlot->setAxisTitle(QwtPlot::xBottom, "Time (s)");
+        avgIPlot = new QwtPlot;
+        avgIPlot->setAxisTitle(QwtPlot::yLeft, "Current (pA)");
+        avgIPlot->setAxisTitle(QwtPlot::xBottom, "Time (s)");
+        layout->addWidget(avgLabel);
+        layout->addWidget(avgVmPlot);
+        layout->addWidget(avgIPlot);
+        const char *names[] = { "Vm", "Vm - SEM", "Vm + SEM", "Command", "AMPA", "GABA", "NMDA" };
+        const Qt::GlobalColor colors[] = { Qt::black, Qt::gray, Qt::gray, Qt::black, Qt::red,
+                                           Qt::blue, Qt::darkGreen
+                                         };
+        for (int i = 0; i < AVG_CHANNELS + 2; i++) {
+            avgCurves[i] = new QwtPlotCurve(names[i]);
+            avgCurves[i]->setPen(QPen(colors[i]));
+            avgCurves[i]->attach(i < 3 ? avgVmPlot : avgIPlot);
+        }
+        avgWindow->resize(600, 500);
+        avgTimer = new QTimer(this);
+        QObject::connect(avgTimer, SIGNAL(timeout()), this, SLOT(refreshAverage()));
+    }
+    refreshAverage();
+    avgWindow->show();
+    avgWindow->raise();
+    avgTimer->start(500);
+}
+
+// Copy a snapshot of the running average, thinned to at most 2000 points, into the plots.
+void Gwaveform::refreshAverage()
+{
+    if (!avgWindow->isVisible()) {
+        avgTimer->stop();
+        return;
+    }
+    size_t stride = avgsamples / 2000 + 1;
+    size_t points = (avgsamples + stride - 1) / stride;
+    std::vector<double> time(points);
+    std::vector<std::vector<double> > y(AVG_CHANNELS + 2, std::vector<double>(points));
+    int trials = 0;
+    double semsum = 0;
+    size_t semcount = 0;
+    for (size_t p = 0; p < points; p++) {
+        size_t i = p * stride;
+        int n = avg[i].count.load(std::memory_order_acquire);
+        double vm = avg[i].channel[0].mean.load(std::memory_order_relaxed);
+        double sem = n > 1 ? sqrt(avg[i].channel[0].m2.load(std::memory_order_relaxed) / (n - 1) / n) : 0;
+        time[p] = i * dt;
+        y[0][p] = vm * 1000; // convert from V to mV
+        y[1][p] = (vm - sem) * 1000;
+        y[2][p] = (vm + sem) * 1000;
+        for (int c = 1; c < AVG_CHANNELS; c++)
+            y[c + 2][p] = avg[i].channel[c].mean.load(std::memory_order_relaxed) * 1e12; // convert from A to pA
+        trials = std::max(trials, n);
+        if (n > 1) {
+            semsum += sem;
+            semcount++;
+        }
+    }
+    for (int i = 0; i < AVG_CHANNELS + 2; i++)
+        avgCurves[i]->setSamples(time.data(), y[i].data(), points);
+    avgVmPlot->replot();
+    avgIPlot->replot();
+    avgLabel->setText(QString("Trials averaged: %1, mean SEM of Vm: %2 mV").arg(trials)
+                      .arg(semcount ? semsum / semcount * 1000 : 0, 0, 'g', 3));
+}
+
+// Write the averages to <data file>-average.dat: sample count and dt, then for
+// each sample the trial count followed by the mean and SD of each channel.
+// Called by pollProtocol() when update(PAUSE) flags a completed protocol, so that
+// the file is written on the GUI thread.
+void Gwaveform::saveAverage()
 {
-    laserStim.clear();
-    for (int i = 0; i < laserDelay / dt; i++) { // initial delay in trial before starting laser
-        laserStim.push_back(0);
+    if (avgsamples == 0) return;
+    QString base = dFile.endsWith(".h5") ? dFile.left(dFile.size() - 3) : dFile;
+    if (!OpenFile(base + "-average.dat")) {
+        printf("Trial average not saved.\n");
+        return;
     }
-    for (int n = 0; n < laserNumPulses; n++) {
-        for (int i = 0; i < laserDuration / dt; i++) {
-            laserStim.push_back(5);
+    stream << (qint64) avgsamples << dt;
+    for (size_t i = 0; i < avgsamples; i++) {
+        int n = avg[i].count.load(std::memory_order_acquire);
+        stream << (qint32) n;
+        for (int c = 0; c < AVG_CHANNELS; c++) {
+            double m2 = avg[i].channel[c].m2.load(std::memory_order_relaxed);
+            stream << avg[i].channel[c].mean.load(std::memory_order_relaxed) << (n > 1 ? sqrt(m2 / (n - 1)) : 0);
         }
-        // fill in zeros for frequency
-        for (int i = 0; i < ((1 / laserFreq) - laserDuration) / dt; i++) {
-            laserStim.push_back(0);
+    }
+    dataFile.close();
+}
+
+void Gwaveform::showScope()
+{
+    if (!scopeWindow) {
+        scopeWindow = new QWidget;
+        scopeWindow->setWindowTitle("Gwaveform Scope");
+        QVBoxLayout *layout = new QVBoxLayout(scopeWindow);
+        scopeLabel = new QLabel;
+        layout->addWidget(scopeLabel);
+        const char *titles[] = { "Current (pA)", "Vm (mV)", "Laser TTL (V)" };
+        for (int i = 0; i < 3; i++) {
+            scopePlots[i] = new QwtPlot;
+            scopePlots[i]->setAxisTitle(QwtPlot::yLeft, titles[i]);
+            layout->addWidget(scopePlots[i]);
         }
+        scopePlots[2]->setAxisTitle(QwtPlot::xBottom, "Time (s)");
+        const char *names[] = { "Command", "AMPA", "GABA", "NMDA", "Laser TTL", "Vm" };
+        const Qt::GlobalColor colors[] = { Qt::black, Qt::red, Qt::blue, Qt::darkGreen,
+                                           Qt::magenta, Qt::black
+                                         };
+        const int plot[] = { 0, 0, 0, 0, 2, 1 };
+        for (int c = 0; c < ScopeBlock::CHANNELS; c++) {
+            scopeCurves[c] = new QwtPlotCurve(names[c]);
+            scopeCurves[c]->setPen(QPen(colors[c]));
+            scopeCurves[c]->attach(scopePlots[plot[c]]);
+            scopeMin[c].resize(SCOPE_BINS);
+            scopeMax[c].resize(SCOPE_BINS);
+        }
+        scopeTime.resize(SCOPE_BINS);
+        scopeWindow->resize(600, 600);
+        scopeTimer = new QTimer(this);
+        QObject::connect(scopeTimer, SIGNAL(timeout()), this, SLOT(refreshScope()));
     }
-    double remainder = stimlength - (laserDelay + 1 / laserFreq * (laserNumPulses
-                                     - 1) + laserDuration);
-    for (int i = 0; i < remainder / dt; i++) { // pad the rest of the stimlength
-        laserStim.push_back(0);
+    // drop what was decimated before the scope was last closed
+    scope.discard();
+    while (scope.front() != NULL) scope.release();
+    scopeHead = 0;
+    scopeFill = 0;
+    scopeWindow->show();
+    scopeWindow->raise();
+    scopeon = true;
+    scopeTimer->start(50);
+}
+
+// Move finished blocks from the decimator into the display ring and redraw each
+// channel as a min/max envelope of at most SCOPE_BINS bins.
+void Gwaveform::refreshScope()
+{
+    if (!scopeWindow->isVisible()) {
+        scopeon = false;
+        scopeTimer->stop();
     }
-    for (int i = 0; i < delay / dt; i++) { // overall delay in trial
-        laserStim.push_back(0);
+    const ScopeBlock *block;
+    while ((block = scope.front()) != NULL) {
+        // count restarts at 0 on every unpause, start a new trace
+        if (scopeFill > 0 && block->start * dt < scopeTime[(scopeHead + SCOPE_BINS - 1) % SCOPE_BINS]) {
+            scopeHead = 0;
+            scopeFill = 0;
+        }
+        for (int b = 0; b < ScopeBlock::BINS; b++) {
+            scopeTime[scopeHead] = (block->start + (long long) b * block->factor) * dt;
+            for (int c = 0; c < ScopeBlock::CHANNELS; c++) {
+                scopeMin[c][scopeHead] = block->min[c][b];
+                scopeMax[c][scopeHead] = block->max[c][b];
+            }
+            scopeHead = (scopeHead + 1) % SCOPE_BINS;
+            if (scopeFill < SCOPE_BINS) scopeFill++;
+        }
+        scope.release();
+    }
+    if (!scopeon) return;
+
+    const double units[] = { 1e12, 1e12, 1e12, 1e12, 1, 1e3 }; // pA, V, mV
+    std::vector<double> x(2 * scopeFill), y(2 * scopeFill);
+    for (int c = 0; c < ScopeBlock::CHANNELS; c++) {
+        for (size_t k = 0; k < scopeFill; k++) {
+            size_t i = (scopeHead + SCOPE_BINS - scopeFill + k) % SCOPE_BINS;
+            x[2 * k] = x[2 * k + 1] = scopeTime[i];
+            y[2 * k] = scopeMin[c][i] * units[c];
+            y[2 * k + 1] = scopeMax[c][i] * units[c];
+        }
+        scopeCurves[c]->setSamples(x.data(), y.data(), 2 * scopeFill);
+    }
+    for (int i = 0; i < 3; i++) scopePlots[i]->replot();
+    scopeLabel->setText(QString("Dropped samples: %1").arg(scope.droppedSamples()));
+}
+
+void Gwaveform::setNoiseKind(int index)
+{
+    noiseAMPA.kind = noiseGABA.kind = index == 1 ? NoiseParams::SHOT : NoiseParams::OU;
+}
+
+// Generate AMPA and GABA conductances from streams 2k and 2k + 1 of the seed for
+// trial k. Only two trials are held: the first two are generated here, and each
+// later one by noiseThread while the trial before it runs.
+void Gwaveform::makeNoise()
+{
+    if (streamon) return;
+    if (noiseAMPA.tau <= 0 || noiseGABA.tau <= 0 || noiselength <= 0) {
+        QMessageBox::critical(this, "Dynamic Clamp", tr(
+                                  "The noise length and time constants must be positive.\n"));
+        return;
     }
+    if (noiseAMPA.mean <= 0 || noiseGABA.mean <= 0 || noiseAMPA.sd <= 0 || noiseGABA.sd <= 0) {
+        QMessageBox::critical(this, "Dynamic Clamp", tr(
+                                  "The noise means and SDs must be positive.\n"));
+        return;
+    }
+    if (noiseAMPA.kind == NoiseParams::SHOT && std::max(shotNoiseRate(noiseAMPA, dt),
+            shotNoiseRate(noiseGABA, dt)) > NOISE_MAX_EVENTS) {
+        QMessageBox::critical(this, "Dynamic Clamp", tr(
+                                  "The shot noise needs more than %1 events per sample. Increase the SD "
+                                  "or the time constant, or lower the mean.\n").arg(NOISE_MAX_EVENTS));
+        return;
+    }
+    std::unique_lock<std::mutex> lock(noiseMutex); // wait for noiseThread to finish a trial
+    noiserequest = -1;
+    noisegen[0] = noiseAMPA;
+    noisegen[1] = noiseGABA;
+    noisegenseed = noiseseed;
+    noisegendt = dt;
+    noiseon = true;
+    noisesamples = lround(noiselength / dt);
+    size_t padding = (delay > 0 ? ceil(delay / dt) : 0) + 1; // one spare sample keeps idx inside the trial
+    stimstride = noisesamples + padding;
+    printf("Generating %s noise with seed %llu\n", noiseAMPA.kind == NoiseParams::SHOT ? "shot" : "OU",
+           noiseseed);
+
+    // the current and NMDA channels stay at zero without storing samples
+    ChannelStats zero = channelStats(NULL, 0);
+    zero.count = noisesamples;
+    stimstats[0] = stimstats[3] = zero;
+    currentwave.assignConstant(0, 2 * stimstride);
+    NMDAwave.assignConstant(0, 2 * stimstride);
+    // kept at 64 bits: with two trials in memory, fixed point saves little
+    AMPAwave.assign(StimulusBuffer::DOUBLE, std::vector<double>(), 2 * stimstride);
+    GABAwave.assign(StimulusBuffer::DOUBLE, std::vector<double>(), 2 * stimstride);
+    noiseready = -1;
+    lock.unlock();
+    rewindNoise();
+    printf("Stimulus memory: %zu bytes\n", currentwave.bytes() + AMPAwave.bytes()
+           + GABAwave.bytes() + NMDAwave.bytes());
+
+    badrows = 0;
+    stimlength = noisesamples * dt;
+    setState("Length (s)", stimlength); // initialized in s, display in s
+    resizeAverage(noisesamples);
+    ready = noisesamples > 0 && checkStimulus();
+    setComment("Stimulus File Name", noiseComment());
+    pauseButton->setEnabled(ready);
+}
+
+// Generate trial t into slot t % 2, which execute() must not be reading, then publish
+// it. Called with noiseMutex held.
+void Gwaveform::fillNoise(int t, unsigned threads)
+{
+    size_t base = (t % 2) * stimstride;
+    std::vector<double> trace;
+    generateNoise(trace, noisesamples, noisegendt, noisegen[0], noisegenseed, 2 * t, threads);
+    if (t == 0) stimstats[1] = channelStats(trace.data(), trace.size()); // statistics of the first trial
+    for (size_t i = 0; i < trace.size(); i++) AMPAwave.set(base + i, trace[i]);
+    generateNoise(trace, noisesamples, noisegendt, noisegen[1], noisegenseed, 2 * t + 1, threads);
+    if (t == 0) stimstats[2] = channelStats(trace.data(), trace.size());
+    for (size_t i = 0; i < trace.size(); i++) GABAwave.set(base + i, trace[i]);
+    noiseready.store(t, std::memory_order_release);
+}
+
+// Make sure the slots hold trials 0 and 1 before a protocol starts. The module is
+// paused, so generation uses every core.
+void Gwaveform::rewindNoise()
+{
+    std::lock_guard<std::mutex> lock(noiseMutex);
+    noiserequest = -1;
+    if (noiseready == (maxtrials > 1 ? 1 : 0)) return;
+    noiseready = -1;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    fillNoise(0, threads);
+    if (maxtrials > 1) fillNoise(1, threads);
+}
+
+// Ask noiseThread for the trial after the one running, whose slot the last trial
+// freed. If generation falls behind, the running trial is generated instead and
+// execute() injects the holding current until it is ready.
+void Gwaveform::prepareNoise()
+{
+    if (!noiseon || streamon) return;
+    int started = trialstarted.load(std::memory_order_acquire);
+    int next = std::max(noiseready.load(std::memory_order_acquire) + 1, started);
+    if (next >= maxtrials || next > started + 1) return;
+    std::unique_lock<std::mutex> lock(noiseMutex, std::try_to_lock);
+    if (!lock.owns_lock()) return; // still generating, try again on the next poll
+    noiserequest = next;
+    noiseWake.notify_one();
+}
+
+// Leave noise mode once noiseThread has finished writing a trial.
+void Gwaveform::stopNoise()
+{
+    std::lock_guard<std::mutex> lock(noiseMutex);
+    noiseon = false;
+    noiserequest = -1;
+}
+
+// Generates requested trials on a single thread so that a running protocol keeps
+// the other cores and the GUI thread free.
+void Gwaveform::runNoiseThread()
+{
+    std::unique_lock<std::mutex> lock(noiseMutex);
+    for (;;) {
+        noiseWake.wait(lock, [this] { return noisequit || noiserequest >= 0; });
+        if (noisequit) return;
+        int t = noiserequest;
+        noiserequest = -1;
+        if (noiseon) fillNoise(t, 1);
+    }
+}
+
+// Runs every 50 ms on the GUI thread and acts on what execute() signalled.
+void Gwaveform::pollProtocol()
+{
+    if (avgdone.exchange(false, std::memory_order_acquire)) saveAverage();
+    prepareNoise();
+}
+
+// Shown instead of the stimulus file name while noise is generated. Entering
+// anything else and clicking Modify loads that file instead.
+QString Gwaveform::noiseComment()
+{
+    return QString("Generated noise (seed %1)").arg((qulonglong) noiseseed);
+}
+
+void Gwaveform::makeLaserTTL()
+{
+    fillLaserTTL(laserStim, storage, dt, laserDelay, laserDuration, laserNumPulses, laserFreq,
+                 stimlength, delay);
 }
 
 void Gwaveform::loadFile()
@@ -568,44 +1288,14 @@ void Gwaveform::loadFile()
         QStringList fileNames = fd->selectedFiles();
         if (!fileNames.isEmpty()) fileName = fileNames.takeFirst();
 
-        printf("Loading new file: %s\n", fileName.toStdString().data());
         gFile = fileName;
-        setComment("Stimulus File Name", fileName);
-        currentwave.clear();
-        GABAwave.clear();
-        AMPAwave.clear();
-        NMDAwave.clear();
-        QFile file(fileName);
-
-        if (file.open(QIODevice::ReadOnly)) {
-            QTextStream stream(&file);
-            double value;
-            while (!stream.atEnd()) {
-                stream >> value;
-                currentwave.push_back(value);
-                stream >> value;
-                AMPAwave.push_back(value);
-                stream >> value;
-                GABAwave.push_back(value);
-                stream >> value;
-                NMDAwave.push_back(value);
-            }
-        }
-        stimlength = GABAwave.size() * dt;
-        setState("Length (s)", stimlength); // initialized in s, display in s
-        // pad waveform to account for wait between trials
-        for (int i = 0; i < delay / dt; i++) {
-            currentwave.push_back(0);
-            GABAwave.push_back(0);
-            AMPAwave.push_back(0);
-            NMDAwave.push_back(0);
-        }
-        ready = true;
+        stopNoise();
+        loadFile(fileName);
     } else {
         setComment("Stimulus File Name", "No file loaded.");
         ready = false;
+        pauseButton->setEnabled(ready);
     }
-    pauseButton->setEnabled(ready);
 }
 
 void Gwaveform::loadFile(QString fileName)
@@ -617,40 +1307,96 @@ void Gwaveform::loadFile(QString fileName)
         return;
     } else {
         printf("Loading new file: %s\n", fileName.toStdString().data());
-        currentwave.clear();
-        GABAwave.clear();
-        AMPAwave.clear();
-        NMDAwave.clear();
+        std::vector<double> current, ampa, gaba, nmda;
+        badrows = 0;
+        stimstride = 0;
         QFile file(fileName);
-        if (file.open(QIODevice::ReadOnly)) {
-            QTextStream stream(&file);
-            double value;
-            while (!stream.atEnd()) {
-                stream >> value;
-                currentwave.push_back(value);
-                stream >> value;
-                AMPAwave.push_back(value);
-                stream >> value;
-                GABAwave.push_back(value);
-                stream >> value;
-                NMDAwave.push_back(value);
+        if (file.open(QIODevice::ReadOnly) && file.size() > 0) {
+            // parse the mapped file in place, without a copy of the text
+            const uchar *text = file.map(0, file.size());
+            if (text) {
+                badrows = parseStimulus(reinterpret_cast<const char *> (text), file.size(), current,
+                                        ampa, gaba, nmda);
+                file.unmap(const_cast<uchar *> (text));
+            } else {
+                QMessageBox::critical(this, "Dynamic Clamp", tr(
+                                          "Could not map the stimulus file %1.\n").arg(fileName));
             }
         }
-        stimlength = GABAwave.size() * dt;
+        stimstats[0] = channelStats(current.data(), current.size());
+        stimstats[1] = channelStats(ampa.data(), ampa.size());
+        stimstats[2] = channelStats(gaba.data(), gaba.size());
+        stimstats[3] = channelStats(nmda.data(), nmda.size());
+        stimlength = gaba.size() * dt;
         setState("Length (s)", stimlength); // initialized in s, display in s
-        // pad waveform with to account for wait between trials
-        for (int i = 0; i < delay / dt; i++) {
-            currentwave.push_back(0);
-            GABAwave.push_back(0);
-            AMPAwave.push_back(0);
-            NMDAwave.push_back(0);
-        }
-        ready = true;
+        // pad waveform to account for wait between trials
+        size_t padding = delay > 0 ? ceil(delay / dt) : 0;
+        storeWaveform(currentwave, current, padding, "Current");
+        storeWaveform(AMPAwave, ampa, padding, "AMPA");
+        storeWaveform(GABAwave, gaba, padding, "GABA");
+        storeWaveform(NMDAwave, nmda, padding, "NMDA");
+        printf("Stimulus memory: %zu bytes\n", currentwave.bytes() + AMPAwave.bytes()
+               + GABAwave.bytes() + NMDAwave.bytes());
+        resizeAverage(gaba.size());
+        ready = checkStimulus();
         setComment("Stimulus File Name", fileName);
     }
     pauseButton->setEnabled(ready);
 }
 
+// Show the statistics of the loaded stimulus and report whether it is safe to run.
+bool Gwaveform::checkStimulus()
+{
+    const double Vtyp = -0.065; // V, membrane potential for the peak current estimate
+    const char *names[] = { "Current", "AMPA", "GABA", "NMDA" };
+    double peak[4]; // A
+    peak[0] = std::max(fabs(stimstats[0].min), fabs(stimstats[0].max));
+    peak[1] = fabs(stimstats[1].max * (Vtyp - AMPArev) * AMPAgain);
+    peak[2] = fabs(stimstats[2].max * (Vtyp - GABArev) * GABAgain);
+    peak[3] = fabs(stimstats[3].max * (Vtyp - NMDArev) / (1 + P1 * exp(-P2 * Vtyp)) * NMDAgain);
+
+    bool ok = stimstats[0].count > 0 && badrows == 0;
+    QString text = "<table><tr><th></th><th>Min</th><th>Max</th><th>Mean</th><th>RMS</th>"
+                   "<th>Non-finite</th><th>Negative</th><th>Peak (pA)</th></tr>";
+    for (int i = 0; i < 4; i++) {
+        const ChannelStats &s = stimstats[i];
+        text += QString("<tr><td>%1</td><td>%2</td><td>%3</td><td>%4</td><td>%5</td>"
+                        "<td>%6</td><td>%7</td><td>%8</td></tr>").arg(names[i])
+                .arg(s.min, 0, 'g', 3).arg(s.max, 0, 'g', 3).arg(s.mean, 0, 'g', 3)
+                .arg(s.rms, 0, 'g', 3).arg(s.nonfinite).arg(s.negative)
+                .arg(peak[i] * 1e12, 0, 'f', 1);
+        if (s.nonfinite > 0 || (i > 0 && s.negative > 0)) ok = false;
+    }
+    text += "</table>";
+    text += QString("Peak current at %1 mV: %2 pA. ").arg(Vtyp * 1000)
+            .arg((peak[0] + peak[1] + peak[2] + peak[3]) * 1e12, 0, 'f', 1);
+    if (badrows > 0) text += "File is truncated or contains unreadable values. ";
+    text += ok ? "<b>Stimulus OK.</b>" : "<b><font color=\"red\">Stimulus rejected.</font></b>";
+    statsLabel->setText(text);
+    if (!ok) printf("Stimulus rejected, see the statistics in the module window.\n");
+    return ok;
+}
+
+// Store one channel in the selected sample format, falling back to doubles
+// if quantization would change any sample by more than 0.01% of the channel peak.
+void Gwaveform::storeWaveform(StimulusBuffer &wave, const std::vector<double> &samples,
+                              size_t padding, const char *name)
+{
+    double peak = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        if (std::isfinite(samples[i])) peak = std::max(peak, fabs(samples[i]));
+    }
+    double error = wave.assign(storage, samples, padding);
+    if (storage == StimulusBuffer::DOUBLE) return;
+    if (error > 1e-4 * peak) {
+        printf("%s: quantization error %g exceeds tolerance, keeping 64-bit samples\n",
+               name, error);
+        wave.assign(StimulusBuffer::DOUBLE, samples, padding);
+    } else {
+        printf("%s: quantized with max error %g (peak %g)\n", name, error, peak);
+    }
+}
+
 void Gwaveform::previewFile()
 {
     double* time = new double[static_cast<int> (GABAwave.size())];
@@ -681,30 +1427,134 @@ void Gwaveform::previewFile()
 
 }
 
+// Map the named stream. On failure the current stimulus, stream or file, stays in use.
+bool Gwaveform::attachStream(QString name)
+{
+    printf("Attaching to stream: %s\n", name.toStdString().data());
+    int fd = shm_open(name.toStdString().data(), O_RDWR, 0);
+    if (fd < 0) {
+        QMessageBox::critical(this, "Dynamic Clamp", tr(
+                                  "Could not open the shared-memory stream %1.\n").arg(name));
+        return false;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || sb.st_size < (off_t) sizeof(GwaveformShmHeader)) {
+        close(fd);
+        QMessageBox::critical(this, "Dynamic Clamp", tr(
+                                  "The shared-memory stream %1 is not initialized.\n").arg(name));
+        return false;
+    }
+    void *addr = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        QMessageBox::critical(this, "Dynamic Clamp", tr(
+                                  "Could not map the shared-memory stream %1.\n").arg(name));
+        return false;
+    }
+
+    GwaveformShmHeader *header = static_cast<GwaveformShmHeader *> (addr);
+    if (header->magic != GWAVEFORM_SHM_MAGIC || header->version != GWAVEFORM_SHM_VERSION
+            || header->capacity == 0 || header->trialframes == 0
+            || (size_t) sb.st_size < gwaveformShmSize(header->capacity)) {
+        munmap(addr, sb.st_size);
+        QMessageBox::critical(this, "Dynamic Clamp", tr(
+                                  "%1 is not a valid Gwaveform stream.\n").arg(name));
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    detachStream();
+    shmHeader = header;
+    shmFrames = gwaveformShmFrames(header);
+    shmSize = sb.st_size;
+    shmCapacity = header->capacity;
+    streamframes = header->trialframes;
+    stimlength = streamframes * dt;
+    setState("Length (s)", stimlength); // initialized in s, display in s
+    bookkeep();
+    resizeAverage(streamframes);
+    statsLabel->setText(QString("Streaming from %1, %2 frames per trial.").arg(name).arg(streamframes));
+    ready = true;
+    pauseButton->setEnabled(ready);
+    return true;
+}
+
+void Gwaveform::detachStream()
+{
+    if (shmHeader) {
+        munmap(shmHeader, shmSize);
+        printf("Detached from stream.\n");
+    }
+    shmHeader = NULL;
+    shmFrames = NULL;
+    shmSize = 0;
+    shmCapacity = 0;
+    streamframes = 0;
+}
+
+// Called from execute(): reads frame seq in place and reports whether it was available.
+// A frame that is not published yet is an underrun and one that was overwritten is an
+// overrun; either way it is skipped, so that later frames keep their place in the trial.
+bool Gwaveform::readStream(uint64_t seq, double &current, double &ampa, double &gaba, double &nmda)
+{
+    if (!shmHeader) {
+        streamUnderruns++;
+        return false;
+    }
+    uint64_t head = shmHeader->writeseq.load(std::memory_order_acquire);
+    if (head < seq) { // producer has not published this frame yet
+        streamUnderruns++;
+        // the frames up to this one are skipped, let the producer catch up to this tick
+        shmHeader->readseq.store(seq - 1, std::memory_order_release);
+        return false;
+    }
+    if (head - seq >= shmCapacity) { // lapped by the producer
+        streamOverruns++;
+        shmHeader->readseq.store(seq, std::memory_order_release);
+        return false;
+    }
+
+    const GwaveformShmFrame &frame = shmFrames[(seq - 1) % shmCapacity];
+    if (frame.seq.load(std::memory_order_acquire) != seq) { // being rewritten
+        streamOverruns++;
+        shmHeader->readseq.store(seq, std::memory_order_release);
+        return false;
+    }
+    current = frame.current;
+    ampa = frame.ampa;
+    gaba = frame.gaba;
+    nmda = frame.nmda;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (frame.seq.load(std::memory_order_relaxed) != seq) { // overwritten while reading
+        streamOverruns++;
+        shmHeader->readseq.store(seq, std::memory_order_release);
+        return false;
+    }
+
+    shmHeader->readseq.store(seq, std::memory_order_release);
+    return true;
+}
+
 bool Gwaveform::OpenFile(QString FName)
 {
     dataFile.setFileName(FName);
     if (dataFile.exists()) {
+        // the file starts with its own header, so appending would corrupt it
         switch (QMessageBox::warning(this, "Dynamic Clamp", tr(
-                                         "This file already exists: %1.\n").arg(FName), "Overwrite", "Append",
-                                     "Cancel", 0, 2)) {
+                                         "This file already exists: %1.\n").arg(FName), "Overwrite",
+                                     "Cancel", QString(), 0, 1)) {
         case 0: // overwrite
             dataFile.remove();
-            if (!dataFile.open(QIODevice::Unbuffered | QIODevice::WriteOnly)) {
-                return false;
-            }
-            break;
-        case 1: // append
-            if (!dataFile.open(QIODevice::Unbuffered | QIODevice::WriteOnly | QIODevice::Append)) {
+            if (!dataFile.open(QIODevice::WriteOnly)) {
                 return false;
             }
             break;
-        case 2: // cancel
+        case 1: // cancel
             return false;
             break;
         }
     } else {
-        if (!dataFile.open(QIODevice::Unbuffered | QIODevice::WriteOnly))
+        if (!dataFile.open(QIODevice::WriteOnly))
             return false;
     }
     stream.setDevice(&dataFile);
@@ -19,11 +19,25 @@
 #include <default_gui_model.h>
 #include <data_recorder.h>
 #include <string>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <scatterplot.h>
 #include <plotdialog.h>
 #include <basicplot.h>
+#include "g-waveform-buffer.h"
+#include "g-waveform-kernels.h"
+#include "g-waveform-noise.h"
+#include "g-waveform-scope.h"
+#include "g-waveform-shm.h"
+#include "g-waveform-stats.h"
 //#include <RTXIprintfilter.h>
 
+class QwtPlot;
+class QwtPlotCurve;
+
 class Gwaveform : public DefaultGUIModel
 {
 
@@ -73,11 +87,43 @@ private:
     bool Iholdon;
     bool recordon;
     double triallength;
-    std::vector<double> currentwave; // absolute current
-    std::vector<double> GABAwave; // conductance waveforms
-    std::vector<double> AMPAwave;
-    std::vector<double> NMDAwave;
-    std::vector<double> laserStim;
+    StimulusBuffer currentwave; // absolute current
+    StimulusBuffer GABAwave; // conductance waveforms
+    StimulusBuffer AMPAwave;
+    StimulusBuffer NMDAwave;
+    StimulusBuffer laserStim;
+    StimulusBuffer::storage_t storage; // sample format used for loaded stimuli
+    ChannelStats stimstats[4]; // current, AMPA, GABA, NMDA as loaded
+    size_t badrows; // truncated or unparsable rows in the stimulus file
+    size_t stimstride; // samples between the two trial slots of the buffers, 0 if every trial is the same
+
+    // Generated background conductances, a fresh stream of the seed for every trial.
+    // Trial k is generated into slot k % 2 by noiseThread while trial k - 1 runs.
+    bool noiseon;
+    NoiseParams noiseAMPA;
+    NoiseParams noiseGABA;
+    double noiselength; // s
+    unsigned long long noiseseed;
+    size_t noisesamples; // per trial
+    double noiseUnderruns; // ticks run on the holding current because a trial was not ready
+    std::atomic<int> noiseready; // last trial generated, published to execute()
+    std::atomic<int> trialstarted; // set by execute() when a trial starts, polled by the GUI
+    std::thread noiseThread;
+    std::mutex noiseMutex; // held while the slots are written
+    std::condition_variable noiseWake;
+    int noiserequest; // trial for noiseThread to generate, -1 if none
+    bool noisequit;
+    NoiseParams noisegen[2]; // AMPA and GABA parameters of the slots
+    unsigned long long noisegenseed;
+    double noisegendt;
+    QComboBox *noiseComboBox;
+    QTimer *pollTimer;
+    void fillNoise(int, unsigned);
+    void rewindNoise();
+    void prepareNoise();
+    void stopNoise();
+    void runNoiseThread();
+    QLabel *statsLabel;
     double spktime;
     int trial;
     long long count;
@@ -90,6 +136,80 @@ private:
     void initParameters();
     void bookkeep();
 
+    // Vm prediction to compensate the one-sample loop delay
+    static const int PRED_BUFFER = 64; // ticks of past predictions kept for diagnostics
+    bool predicton;
+    int predorder;
+    double predlatency; // s
+    double Vhist[3]; // last Vm samples, newest first
+    int nhist;
+    double predbuf[PRED_BUFFER];
+    double prederrsum;
+    long long prederrn;
+    double predRMSerr; // mV
+    double predMaxErr; // mV
+    QComboBox *predComboBox;
+    double compensateVm();
+
+    // Running mean and variance across trials, indexed by idx. Only allocated while
+    // averaging is on; one record per sample keeps the real-time update on adjacent lines.
+    static const int AVG_CHANNELS = 5; // Vm, command, AMPA, GABA, NMDA
+    struct AverageRecord {
+        std::atomic<int> count; // trials accumulated at this sample
+        struct {
+            std::atomic<double> mean;
+            std::atomic<double> m2; // sum of squared deviations
+        } channel[AVG_CHANNELS];
+    };
+    bool avgon;
+    size_t avglength; // samples per trial of the current stimulus
+    size_t avgsamples; // records allocated, 0 while averaging is off
+    std::vector<AverageRecord> avg; // written by execute(), read by the GUI
+    std::atomic<bool> avgdone; // protocol completed, save the average
+    QWidget *avgWindow;
+    QLabel *avgLabel;
+    QwtPlot *avgVmPlot;
+    QwtPlot *avgIPlot;
+    QwtPlotCurve *avgCurves[AVG_CHANNELS + 2]; // Vm, Vm +/- SEM, currents
+    QTimer *avgTimer;
+    void resizeAverage(size_t);
+    void accumulateAverage();
+
+    // Live scope of the outputs, fed by a min/max decimator in execute()
+    static const int SCOPE_BINS = 2048; // bins shown, bounds the redraw cost
+    ScopeDecimator scope;
+    std::atomic<bool> scopeon;
+    QWidget *scopeWindow;
+    QLabel *scopeLabel;
+    QwtPlot *scopePlots[3]; // currents, Vm, laser TTL
+    QwtPlotCurve *scopeCurves[ScopeBlock::CHANNELS];
+    QTimer *scopeTimer;
+    std::vector<double> scopeTime; // display ring of the latest bins
+    std::vector<double> scopeMin[ScopeBlock::CHANNELS];
+    std::vector<double> scopeMax[ScopeBlock::CHANNELS];
+    size_t scopeHead;
+    size_t scopeFill;
+    QString noiseComment();
+    void storeWaveform(StimulusBuffer &, const std::vector<double> &, size_t, const char *);
+    bool checkStimulus();
+
+    // Shared-memory stream input from an external producer process
+    bool streamon;
+    QString shmName;
+    GwaveformShmHeader *shmHeader; // mapped segment, only changed while paused
+    GwaveformShmFrame *shmFrames;
+    size_t shmSize;
+    uint32_t shmCapacity;
+    uint32_t streamframes; // frames per trial announced by the producer
+    uint64_t streambase; // frame before the first one of trial 0, a multiple of streamframes
+    double streamUnderruns;
+    double streamOverruns;
+    QCheckBox *streamCheckBox;
+    QComboBox *storageComboBox;
+    bool attachStream(QString);
+    void detachStream();
+    bool readStream(uint64_t, double &, double &, double &, double &);
+
     // Functions and parameters for saving data to file without using data recorder
     bool OpenFile(QString);
     QFile dataFile;
@@ -108,4 +228,17 @@ private slots:
     void toggleLaserTTL(bool);
     void toggleIhold(bool);
     void toggleRecord(bool);
+    void toggleStream(bool);
+    void setStorage(int);
+    void togglePrediction(bool);
+    void setPredictionOrder(int);
+    void toggleAverage(bool);
+    void showAverage();
+    void refreshAverage();
+    void saveAverage();
+    void showScope();
+    void refreshScope();
+    void makeNoise();
+    void pollProtocol();
+    void setNoiseKind(int);
 };
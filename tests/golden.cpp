@@ -0,0 +1,740 @@
+/*
+ Copyright (C) 2011 Georgia Institute of Technology
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+ * Golden-trace tests. The kernels used by the plugin (g-waveform-kernels.h,
+ * g-waveform-buffer.h, g-waveform-stats.h) are run over synthetic stimuli,
+ * Vm traces and every toggle combination, and compared output by output with
+ * the original implementation copied below. A sample passes if it is within
+ * the ULP tolerance or within its absolute bound: zero for exact variants,
+ * the propagated quantization error for fixed-point storage, the rounding
+ * error of the arithmetic for the others, plus --abs. The largest deviation
+ * of every check is reported. The background noise generator
+ * (g-waveform-noise.h) is checked for bit-reproducibility across thread
+ * counts, against the plain sequential recursion and for its mean and SD.
+ * Runs without RTXI or Qt:
+ *
+ *   make test                          (from the top directory or tests/)
+ *   ./golden [--ulp N] [--pred-ulp N] [--abs X] [--verbose]
+ */
+
+#include "g-waveform-kernels.h"
+#include "g-waveform-noise.h"
+#include "g-waveform-stats.h"
+
+#include <cfloat>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <locale>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static double ulpTolerance = 0; // exact kernels must match bit for bit by default
+static double predUlpTolerance = 64;
+static double absTolerance = 0; // added to every absolute bound
+static bool verbose = false;
+
+// Distance between two doubles in units in the last place
+static double ulps(double a, double b)
+{
+    if (a == b || (std::isnan(a) && std::isnan(b))) return 0;
+    if (std::isnan(a) || std::isnan(b)) return std::numeric_limits<double>::infinity();
+    int64_t ia, ib;
+    memcpy(&ia, &a, sizeof(a));
+    memcpy(&ib, &b, sizeof(b));
+    if (ia < 0) ia = INT64_MIN - ia;
+    if (ib < 0) ib = INT64_MIN - ib;
+    return (double) (ia > ib ? (uint64_t) ia - (uint64_t) ib : (uint64_t) ib - (uint64_t) ia);
+}
+
+class Check
+{
+
+public:
+    Check(const std::string &name, double ulpTol) : name(name), ulpTol(ulpTol), compared(0),
+        failures(0), maxAbs(0), maxUlp(0) {}
+
+    // Compare got against ref; bound is the absolute deviation the variant is allowed.
+    void compare(double ref, double got, double bound, const std::string &where)
+    {
+        compared++;
+        double u = ulps(ref, got);
+        double d = u == 0 ? 0 : fabs(got - ref);
+        if (std::isnan(d)) d = std::numeric_limits<double>::infinity();
+        if (d > maxAbs || (d == maxAbs && u > maxUlp)) worst = where;
+        maxAbs = std::max(maxAbs, d);
+        maxUlp = std::max(maxUlp, u);
+        if (u > ulpTol && d > bound + absTolerance) {
+            if (failures < 5 || verbose)
+                printf("  FAIL %s: %s expected %.17g got %.17g (%g ULP, bound %g)\n", name.c_str(),
+                       where.c_str(), ref, got, u, bound + absTolerance);
+            failures++;
+        }
+    }
+
+    // Compare two counts or flags exactly.
+    void expect(bool ok, const std::string &where)
+    {
+        compared++;
+        if (!ok) {
+            if (failures < 5 || verbose) printf("  FAIL %s: %s\n", name.c_str(), where.c_str());
+            failures++;
+        }
+    }
+
+    bool report(void) const
+    {
+        printf("%-34s %10zu %12.3g %10.3g  %-6s %s\n", name.c_str(), compared, maxAbs, maxUlp,
+               failures ? "FAIL" : "ok", worst.c_str());
+        return failures == 0;
+    }
+
+private:
+    std::string name;
+    double ulpTol;
+    size_t compared;
+    size_t failures;
+    double maxAbs;
+    double maxUlp;
+    std::string worst;
+};
+
+static std::string describe(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static std::string describe(const char *fmt, ...)
+{
+    char text[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+    return text;
+}
+
+// Deterministic uniform deviates in [0, 1)
+static double uniform(uint64_t &state)
+{
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (state >> 11) / 9007199254740992.0;
+}
+
+/*
+ * Original implementation, as in execute(), makeLaserTTL() and loadFile()
+ * before the kernels were factored out.
+ */
+
+struct ReferenceModule {
+    double Vm;
+    double GABArev, GABAgain, AMPArev, AMPAgain, NMDArev, NMDAgain, P1, P2;
+    bool currenton, ampaon, gabaon, nmdaon, clampon, laserTTLon;
+    std::vector<double> currentwave, GABAwave, AMPAwave, NMDAwave, laserStim;
+    int idx;
+    double out[6];
+
+    double &output(int i)
+    {
+        return out[i];
+    }
+
+    // body of execute() for a tick of a trial after the wait
+    void tick(void)
+    {
+        if (clampon == true) { // determine injected current
+            if (ampaon == true) {
+                output(1) = -1 * AMPAwave[idx] * (Vm - AMPArev) * AMPAgain;
+            } else {
+                output(1) = 0;
+            }
+            if (gabaon == true) {
+                output(2) = -1 * GABAwave[idx] * (Vm - GABArev) * GABAgain;
+            } else {
+                output(2) = 0;
+            }
+            if (nmdaon == true) {
+                output(3) = -1 * NMDAwave[idx] * (Vm - NMDArev) * 1 / (1 + P1
+                            * exp(-P2 * Vm)) * NMDAgain;
+            } else {
+                output(3) = 0;
+            }
+            output(0) = output(1) + output(2) + output(3);
+            if (currenton == true) {
+                output(0) = output(0) + currentwave[idx];
+            }
+        } else if (clampon == false) {
+            output(1) = 0;
+            output(2) = 0;
+            output(3) = 0;
+            output(0) = 0;
+        }
+
+        if (laserTTLon == true) { // determine TTL stimulus
+            output(4) = laserStim[idx];
+        } else if (laserTTLon == false) {
+            output(4) = 0;
+        }
+    }
+};
+
+static void referenceLaserTTL(std::vector<double> &laserStim, double dt, double laserDelay,
+                              double laserDuration, double laserNumPulses, double laserFreq,
+                              double stimlength, double delay)
+{
+    laserStim.clear();
+    for (int i = 0; i < laserDelay / dt; i++) { // initial delay in trial before starting laser
+        laserStim.push_back(0);
+    }
+    for (int n = 0; n < laserNumPulses; n++) {
+        for (int i = 0; i < laserDuration / dt; i++) {
+            laserStim.push_back(5);
+        }
+        // fill in zeros for frequency
+        for (int i = 0; i < ((1 / laserFreq) - laserDuration) / dt; i++) {
+            laserStim.push_back(0);
+        }
+    }
+    double remainder = stimlength - (laserDelay + 1 / laserFreq * (laserNumPulses
+                                     - 1) + laserDuration);
+    for (int i = 0; i < remainder / dt; i++) { // pad the rest of the stimlength
+        laserStim.push_back(0);
+    }
+    for (int i = 0; i < delay / dt; i++) { // overall delay in trial
+        laserStim.push_back(0);
+    }
+}
+
+// Row-by-row parse of four values with the C locale, stopping at the first bad row
+static size_t referenceParse(const std::string &text, std::vector<double> col[4])
+{
+    std::istringstream stream(text);
+    stream.imbue(std::locale::classic());
+    stream >> std::ws;
+    while (!stream.eof()) {
+        double value[4];
+        for (int c = 0; c < 4; c++) stream >> value[c];
+        if (stream.fail()) return 1;
+        for (int c = 0; c < 4; c++) col[c].push_back(value[c]);
+        stream >> std::ws;
+    }
+    return 0;
+}
+
+// Lagrange extrapolation through (0, v0), (-1, v1), (-2, v2) in long double
+static long double referencePredict(int order, long double s, long double v0, long double v1,
+                                    long double v2)
+{
+    const long double t[3] = { 0, -1, -2 };
+    const long double v[3] = { v0, v1, v2 };
+    long double sum = 0;
+    for (int i = 0; i <= order; i++) {
+        long double term = v[i];
+        for (int j = 0; j <= order; j++)
+            if (j != i) term *= (s - t[j]) / (t[i] - t[j]);
+        sum += term;
+    }
+    return sum;
+}
+
+/*
+ * Synthetic corpus
+ */
+
+static const size_t SAMPLES = 3000;
+static const char *storageNames[] = { "64-bit", "32-bit", "16-bit" };
+
+static std::vector<std::vector<double> > vmTraces(void)
+{
+    std::vector<std::vector<double> > traces(5, std::vector<double>(SAMPLES));
+    uint64_t state = 1;
+    double walk = -0.065;
+    for (size_t i = 0; i < SAMPLES; i++) {
+        traces[0][i] = -0.065; // resting
+        traces[1][i] = -0.06 + 0.03 * sin(2 * M_PI * i / 500.0); // slow oscillation
+        walk += 0.0005 * (uniform(state) - 0.5);
+        traces[2][i] = walk; // noisy
+        traces[3][i] = (i / 250) % 2 ? 0.02 : -0.08; // steps through the reversal potentials
+        traces[4][i] = (uniform(state) - 0.5) * 0.2; // broadband, crosses 0 V often
+    }
+    return traces;
+}
+
+// current (A), AMPA, GABA, NMDA (S) with sparse exponentially decaying events
+static void stimulus(uint64_t seed, std::vector<double> col[4])
+{
+    uint64_t state = seed;
+    double g[3] = { 0, 0, 0 };
+    for (int c = 0; c < 4; c++) col[c].assign(SAMPLES, 0);
+    for (size_t i = 0; i < SAMPLES; i++) {
+        for (int c = 0; c < 3; c++) {
+            g[c] *= 0.97;
+            if (uniform(state) < 0.02) g[c] += 5e-9 * uniform(state);
+            col[c + 1][i] = g[c];
+        }
+        col[0][i] = (uniform(state) - 0.5) * 200e-12;
+    }
+}
+
+static bool testClamp(void)
+{
+    Check exact("execute outputs, 64-bit", ulpTolerance);
+    Check fixed32("execute outputs, 32-bit", ulpTolerance);
+    Check fixed16("execute outputs, 16-bit", ulpTolerance);
+    Check *checks[] = { &exact, &fixed32, &fixed16 };
+
+    const ClampSettings params[] = {
+        { false, false, false, false, false, false, 0, 1, -0.070, 1, 0, 1, .002, .109 }, // defaults
+        { false, false, false, false, false, false, 0.005, 2.5, -0.080, 0.5, 0.01, 1.3, 0.28, 62 },
+    };
+    std::vector<std::vector<double> > traces = vmTraces();
+    const size_t padding = 7;
+
+    for (int storage = 0; storage < 3; storage++) {
+        StimulusBuffer::storage_t mode = (StimulusBuffer::storage_t) storage;
+        for (uint64_t seed = 1; seed <= 2; seed++) {
+            ReferenceModule ref;
+            std::vector<double> col[4];
+            stimulus(seed, col);
+            StimulusBuffer buf[4], laser;
+            double error[4];
+            for (int c = 0; c < 4; c++) {
+                error[c] = buf[c].assign(mode, col[c], padding);
+                col[c].insert(col[c].end(), padding, 0);
+            }
+            fillLaserTTL(laser, mode, 1e-3, 0.3, 0.05, 4, 5, SAMPLES * 1e-3, padding * 1e-3);
+            referenceLaserTTL(ref.laserStim, 1e-3, 0.3, 0.05, 4, 5, SAMPLES * 1e-3, padding * 1e-3);
+            ref.currentwave = col[0];
+            ref.AMPAwave = col[1];
+            ref.GABAwave = col[2];
+            ref.NMDAwave = col[3];
+
+            for (size_t p = 0; p < sizeof(params) / sizeof(params[0]); p++) {
+                for (int toggles = 0; toggles < 64; toggles++) {
+                    ClampSettings s = params[p];
+                    s.currenton = toggles & 1;
+                    s.ampaon = toggles & 2;
+                    s.gabaon = toggles & 4;
+                    s.nmdaon = toggles & 8;
+                    s.clampon = toggles & 16;
+                    s.laserTTLon = toggles & 32;
+                    ref.currenton = s.currenton;
+                    ref.ampaon = s.ampaon;
+                    ref.gabaon = s.gabaon;
+                    ref.nmdaon = s.nmdaon;
+                    ref.clampon = s.clampon;
+                    ref.laserTTLon = s.laserTTLon;
+                    ref.AMPArev = s.AMPArev;
+                    ref.AMPAgain = s.AMPAgain;
+                    ref.GABArev = s.GABArev;
+                    ref.GABAgain = s.GABAgain;
+                    ref.NMDArev = s.NMDArev;
+                    ref.NMDAgain = s.NMDAgain;
+                    ref.P1 = s.P1;
+                    ref.P2 = s.P2;
+
+                    for (size_t t = 0; t < traces.size(); t++) {
+                        for (size_t i = 0; i < SAMPLES + padding; i++) {
+                            ref.Vm = traces[t][i % SAMPLES];
+                            ref.idx = i;
+                            ref.tick();
+                            double out[5];
+                            clampOutputs(s, ref.Vm, buf[0][i], buf[1][i], buf[2][i], buf[3][i],
+                                         s.laserTTLon ? laser[i] : 0, out);
+
+                            // quantization error propagated through each current, plus rounding
+                            double bound[5] = { 0, 0, 0, 0, 0 };
+                            if (mode != StimulusBuffer::DOUBLE && s.clampon) {
+                                if (s.ampaon) bound[1] = error[1] * fabs((ref.Vm - s.AMPArev) * s.AMPAgain);
+                                if (s.gabaon) bound[2] = error[2] * fabs((ref.Vm - s.GABArev) * s.GABAgain);
+                                if (s.nmdaon) bound[3] = error[3] * fabs((ref.Vm - s.NMDArev) * s.NMDAgain);
+                                bound[0] = bound[1] + bound[2] + bound[3] + (s.currenton ? error[0] : 0);
+                                for (int k = 0; k < 4; k++)
+                                    bound[k] = bound[k] * (1 + 1e-9) + 8 * DBL_EPSILON * fabs(ref.out[k]);
+                            }
+                            for (int k = 0; k < 5; k++) {
+                                checks[storage]->compare(ref.out[k], out[k], bound[k], describe(
+                                                             "output(%d) tick %zu Vm trace %zu toggles %02x params %zu seed %llu",
+                                                             k, i, t, toggles, p, (unsigned long long) seed));
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    bool ok = true;
+    for (int i = 0; i < 3; i++) ok = checks[i]->report() && ok;
+    return ok;
+}
+
+static bool testLaserTTL(void)
+{
+    bool ok = true;
+    const double dts[] = { 1e-3, 1e-4, 5e-5, 3.3e-5 };
+    for (int storage = 0; storage < 3; storage++) {
+        Check check(describe("makeLaserTTL, %s", storageNames[storage]), ulpTolerance);
+        for (size_t d = 0; d < sizeof(dts) / sizeof(dts[0]); d++) {
+            for (int pulses = 1; pulses <= 5; pulses += 2) {
+                for (double freq = 1; freq <= 20; freq *= 4) {
+                    double dt = dts[d], duration = 0.4 / freq, laserDelay = 0.25, delay = 0.7;
+                    double stimlength = laserDelay + pulses / freq + 0.1;
+                    std::vector<double> ref;
+                    StimulusBuffer got;
+                    referenceLaserTTL(ref, dt, laserDelay, duration, pulses, freq, stimlength, delay);
+                    fillLaserTTL(got, (StimulusBuffer::storage_t) storage, dt, laserDelay, duration,
+                                 pulses, freq, stimlength, delay);
+                    std::string where = describe("dt %g pulses %d freq %g", dt, pulses, freq);
+                    check.expect(got.size() == ref.size(), "length, " + where);
+                    for (size_t i = 0; i < std::min(ref.size(), got.size()); i++)
+                        check.compare(ref[i], got[i], 0, describe("sample %zu, ", i) + where);
+                }
+            }
+        }
+        ok = check.report() && ok;
+    }
+    return ok;
+}
+
+static bool testPredictVm(void)
+{
+    Check hold("predictVm, order 0", 0);
+    Check linear("predictVm, order 1", predUlpTolerance);
+    Check quadratic("predictVm, order 2", predUlpTolerance);
+    Check *checks[] = { &hold, &linear, &quadratic };
+    const double latencies[] = { 0, 0.25, 0.5, 1, 1.7, 3, 10 };
+    std::vector<std::vector<double> > traces = vmTraces();
+    for (int order = 0; order <= 2; order++) {
+        for (size_t l = 0; l < sizeof(latencies) / sizeof(latencies[0]); l++) {
+            double s = latencies[l];
+            for (size_t t = 0; t < traces.size(); t++) {
+                for (size_t i = 2; i < SAMPLES; i++) {
+                    double v0 = traces[t][i], v1 = traces[t][i - 1], v2 = traces[t][i - 2];
+                    double got = predictVm(order, s, v0, v1, v2);
+                    double ref = (double) referencePredict(order, s, v0, v1, v2);
+                    // rounding error of the weighted sum
+                    double scale = order == 0 ? 0 : order == 1 ? (1 + s) * fabs(v0) + s * fabs(v1)
+                                   : (s + 1) * (s + 2) / 2 * fabs(v0) + s * (s + 2) * fabs(v1)
+                                   + s * (s + 1) / 2 * fabs(v2);
+                    checks[order]->compare(ref, got, 8 * DBL_EPSILON * scale,
+                                           describe("latency %g trace %zu sample %zu", s, t, i));
+                }
+            }
+        }
+    }
+    bool ok = true;
+    for (int i = 0; i < 3; i++) ok = checks[i]->report() && ok;
+    return ok;
+}
+
+static bool testStimulusBuffer(void)
+{
+    bool ok = true;
+    uint64_t state = 7;
+    std::vector<std::vector<double> > channels(7, std::vector<double>(SAMPLES));
+    for (size_t i = 0; i < SAMPLES; i++) {
+        channels[0][i] = 0; // silent channel
+        channels[1][i] = 3e-9; // constant
+        channels[2][i] = 20e-9 * uniform(state); // conductance
+        channels[3][i] = -70e-12 * uniform(state); // negative current
+        channels[4][i] = (uniform(state) - 0.3) * 1e-10; // mixed sign
+        channels[5][i] = 1e-15 * uniform(state); // tiny
+        channels[6][i] = 5e-9 * uniform(state);
+    }
+    channels[6][10] = std::numeric_limits<double>::quiet_NaN();
+    channels[6][20] = std::numeric_limits<double>::infinity();
+    const size_t padding = 11;
+
+    for (int storage = 0; storage < 3; storage++) {
+        StimulusBuffer::storage_t mode = (StimulusBuffer::storage_t) storage;
+        Check check(describe("StimulusBuffer round trip, %s", storageNames[storage]), 0);
+        double maxcode = mode == StimulusBuffer::FIXED16 ? 32767.0 : 2147483647.0;
+        for (size_t c = 0; c < channels.size(); c++) {
+            const std::vector<double> &x = channels[c];
+            StimulusBuffer buf, pushed;
+            double error = buf.assign(mode, x, padding);
+            double lo = 0, hi = 0, measured = 0;
+            bool nonfinite = false;
+            for (size_t i = 0; i < x.size(); i++) {
+                if (!std::isfinite(x[i])) {
+                    nonfinite = true;
+                    continue;
+                }
+                lo = std::min(lo, x[i]);
+                hi = std::max(hi, x[i]);
+            }
+            pushed.reset(mode, lo, hi);
+            for (size_t i = 0; i < x.size(); i++) pushed.push_back(x[i]);
+            for (size_t i = 0; i < padding; i++) pushed.push_back(0);
+            StimulusBuffer overwritten; // zeros overwritten in place, as for generated noise
+            overwritten.reset(mode, lo, hi);
+            for (size_t i = 0; i < x.size() + padding; i++) overwritten.push_back(0);
+            for (size_t i = 0; i < x.size(); i++) overwritten.set(i, x[i]);
+
+            std::string where = describe("channel %zu", c);
+            check.expect(buf.size() == x.size() + padding, "length, " + where);
+            check.expect(buf.storage() == mode, "storage, " + where);
+            // half a step, with the spare step of the range
+            double bound = mode == StimulusBuffer::DOUBLE ? 0 : (hi - lo) / (2 * (maxcode - 1)) / 2
+                           * (1 + 1e-9) + 4 * DBL_EPSILON * std::max(fabs(lo), fabs(hi));
+            for (size_t i = 0; i < x.size(); i++) {
+                std::string at = describe("sample %zu, ", i) + where;
+                check.compare(buf[i], pushed[i], 0, "push_back matches assign, " + at);
+                check.compare(buf[i], overwritten[i], 0, "set matches assign, " + at);
+                if (std::isfinite(x[i])) {
+                    measured = std::max(measured, fabs(buf[i] - x[i]));
+                    check.compare(x[i], buf[i], bound, at);
+                } else if (mode == StimulusBuffer::DOUBLE) {
+                    check.expect(std::isnan(x[i]) ? std::isnan(buf[i]) : buf[i] == x[i], "non-finite kept, " + at);
+                } else {
+                    check.expect(buf[i] == 0, "non-finite stored as zero, " + at);
+                }
+            }
+            for (size_t i = x.size(); i < buf.size(); i++)
+                check.expect(buf[i] == 0 && !std::signbit(buf[i]), describe("padding %zu is +0, ", i) + where);
+            if (nonfinite && mode != StimulusBuffer::DOUBLE)
+                check.expect(std::isinf(error), "reported error is infinite, " + where);
+            else
+                check.expect(error == measured, "reported error matches, " + where);
+        }
+        ok = check.report() && ok;
+    }
+
+    Check constant("StimulusBuffer, constant", 0);
+    StimulusBuffer buf;
+    buf.assign(StimulusBuffer::DOUBLE, channels[2], padding);
+    buf.assignConstant(0, SAMPLES);
+    constant.expect(buf.size() == SAMPLES && buf.bytes() == 0, "no samples stored");
+    for (size_t i = 0; i < SAMPLES; i++) {
+        buf.set(i, 1);
+        constant.compare(0, buf[i], 0, describe("sample %zu", i));
+    }
+    buf.assignConstant(-2.5e-9, 10);
+    buf.push_back(0);
+    constant.expect(buf.size() == 11 && buf[10] == -2.5e-9, "push_back extends");
+    return constant.report() && ok;
+}
+
+static bool testStats(void)
+{
+    Check check("channelStats", 0);
+    uint64_t state = 11;
+    const size_t lengths[] = { 0, 1, 2, 3, 5, 16, 17, 1000, 100001 };
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        for (int variant = 0; variant < 3; variant++) {
+            size_t n = lengths[l];
+            std::vector<double> x(n);
+            for (size_t i = 0; i < n; i++) x[i] = (uniform(state) - 0.2) * 1e-8;
+            if (variant > 0 && n > 2) {
+                x[n / 2] = std::numeric_limits<double>::quiet_NaN();
+                x[n - 1] = variant == 1 ? std::numeric_limits<double>::infinity()
+                           : -std::numeric_limits<double>::infinity();
+            }
+            // scalar reference
+            double lo = std::numeric_limits<double>::infinity(), hi = -lo, sum = 0, sumsq = 0, sumabs = 0;
+            size_t finite = 0, negative = 0;
+            for (size_t i = 0; i < n; i++) {
+                if (x[i] < 0) negative++;
+                if (!std::isfinite(x[i])) continue;
+                lo = std::min(lo, x[i]);
+                hi = std::max(hi, x[i]);
+                sum += x[i];
+                sumsq += x[i] * x[i];
+                sumabs += fabs(x[i]);
+                finite++;
+            }
+            ChannelStats s = channelStats(x.data(), n);
+            std::string where = describe("length %zu variant %d", n, variant);
+            check.expect(s.count == n, "count, " + where);
+            check.expect(s.nonfinite == n - finite, "non-finite, " + where);
+            check.expect(s.negative == negative, "negative, " + where);
+            check.compare(finite ? lo : 0, s.min, 0, "min, " + where);
+            check.compare(finite ? hi : 0, s.max, 0, "max, " + where);
+            // summation order differs, allow the rounding error of a sum of n terms
+            double mean = finite ? sum / finite : 0, rms = finite ? sqrt(sumsq / finite) : 0;
+            double tol = 2 * n * DBL_EPSILON;
+            check.compare(mean, s.mean, tol * (finite ? sumabs / finite : 0), "mean, " + where);
+            check.compare(rms, s.rms, tol * rms, "rms, " + where);
+        }
+    }
+    return check.report();
+}
+
+static bool testParser(void)
+{
+    Check check("parseStimulus", 0);
+    uint64_t state = 3;
+    const char *separators[] = { " ", "\t", "   ", " \t " };
+    const char *newlines[] = { "\n", "\r\n", "\n\n" };
+    for (int variant = 0; variant < 24; variant++) {
+        std::string text = variant % 5 == 0 ? "\n  \n" : ""; // leading blank lines
+        size_t rows = 1 + variant * 37;
+        for (size_t r = 0; r < rows; r++) {
+            for (int c = 0; c < 4; c++) {
+                double v = c == 0 ? (uniform(state) - 0.5) * 1e-10 : uniform(state) * 1e-8;
+                if (uniform(state) < 0.05) v = 0;
+                text += describe(variant % 2 ? "%.17g" : "%.16e", v);
+                text += c < 3 ? separators[variant % 4] : newlines[variant % 3];
+            }
+        }
+        if (variant % 4 == 3) text.erase(text.find_last_not_of("\r\n") + 1); // no final newline
+        if (variant % 6 == 5) text += "1e-9 2e-9\n"; // truncated row
+        if (variant % 7 == 6) text += "1e-9 abc 2e-9 3e-9\n4 5 6 7\n"; // unreadable row
+
+        std::vector<double> ref[4], got[4];
+        size_t refbad = referenceParse(text, ref);
+        // parse from an exact-size copy, as from a mapped file without a terminator
+        std::vector<char> mapped(text.begin(), text.end());
+        size_t gotbad = parseStimulus(mapped.data(), mapped.size(), got[0], got[1], got[2], got[3]);
+        std::string where = describe("file %d", variant);
+        check.expect(refbad == gotbad, "bad rows, " + where);
+        for (int c = 0; c < 4; c++) {
+            check.expect(ref[c].size() == got[c].size(), describe("rows in column %d, ", c) + where);
+            for (size_t i = 0; i < std::min(ref[c].size(), got[c].size()); i++)
+                check.compare(ref[c][i], got[c][i], 0, describe("row %zu column %d, ", i, c) + where);
+        }
+    }
+
+    // non-finite values are parsed and left to validation
+    std::vector<double> col[4];
+    const char *nonfinite = "nan 1 2 3\ninf -inf 0 4e-9\n";
+    size_t bad = parseStimulus(nonfinite, strlen(nonfinite), col[0], col[1], col[2], col[3]);
+    check.expect(bad == 0 && col[0].size() == 2, "non-finite rows parsed");
+    check.expect(col[0].size() == 2 && std::isnan(col[0][0]) && std::isinf(col[0][1])
+                 && col[1][1] < 0 && col[3][1] == 4e-9, "non-finite values");
+
+    // nothing past the given length is read, even when the last number could continue there
+    const char unterminated[] = "1 2 3 4\n5 6 7 8e-95"; // the final 5 lies past the length
+    for (int c = 0; c < 4; c++) col[c].clear();
+    bad = parseStimulus(unterminated, sizeof(unterminated) - 2, col[0], col[1], col[2], col[3]);
+    check.expect(bad == 0 && col[0].size() == 2 && col[3][1] == 8e-9, "text without terminator");
+    for (int c = 0; c < 4; c++) col[c].clear();
+    bad = parseStimulus(unterminated, 14, col[0], col[1], col[2], col[3]); // "1 2 3 4\n5 6 7 "
+    check.expect(bad == 1 && col[0].size() == 1, "truncated row at the end of the text");
+
+    // the decimal separator does not follow the process locale
+    if (setlocale(LC_NUMERIC, "de_DE.UTF-8") || setlocale(LC_NUMERIC, "fr_FR.UTF-8")) {
+        for (int c = 0; c < 4; c++) col[c].clear();
+        parseStimulus("1.5 2.5 3.5 4.5\n", 16, col[0], col[1], col[2], col[3]);
+        check.expect(col[0].size() == 1 && col[0][0] == 1.5 && col[3][0] == 4.5, "C locale numbers");
+        setlocale(LC_NUMERIC, "C");
+    }
+    return check.report();
+}
+
+// Sequential recursion y[k] = a y[k-1] + d[k] with the drive of generateNoise(), rectified at zero
+static void referenceNoise(std::vector<double> &out, size_t n, double dt, const NoiseParams &p,
+                           uint64_t seed, uint32_t stream)
+{
+    const double a = exp(-dt / p.tau);
+    const double b = p.sd * sqrt(1 - a * a);
+    const double amp = (1 + a) * p.sd * p.sd / p.mean;
+    const double rate = p.mean * (1 - a) / amp;
+    double y = 0;
+    out.resize(n);
+    for (size_t k = 0; k < n; k++) {
+        double u1, u2, d = 0;
+        noiseUniforms(seed, stream, k, u1, u2);
+        if (p.kind == NoiseParams::OU) {
+            d = (k == 0 ? p.sd : b) * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+        } else if (k > 0) {
+            int events = 0;
+            double prob = exp(-rate), cdf = prob;
+            while (u1 > cdf && events < 1000) {
+                events++;
+                prob *= rate / events;
+                cdf += prob;
+            }
+            d = amp * events - p.mean * (1 - a);
+        }
+        y = a * y + d;
+        out[k] = std::max(0.0, y + p.mean);
+    }
+}
+
+static bool testNoise(void)
+{
+    Check threads("generateNoise, 1 vs 4 threads", 0);
+    Check sequential("generateNoise, sequential", ulpTolerance);
+    Check moments("generateNoise, mean and SD", 0);
+    const double dt = 1e-4;
+    const NoiseParams params[] = {
+        { NoiseParams::OU, 12e-9, 3e-9, 2.7e-3 }, // AMPA and GABA of Destexhe et al. (2001)
+        { NoiseParams::OU, 57e-9, 6.6e-9, 10.5e-3 },
+        { NoiseParams::SHOT, 12e-9, 3e-9, 2.7e-3 },
+        { NoiseParams::SHOT, 57e-9, 6.6e-9, 10.5e-3 },
+    };
+    const size_t n = 200000; // four chunks, the last one partial
+    for (size_t p = 0; p < sizeof(params) / sizeof(params[0]); p++) {
+        for (uint32_t stream = 0; stream < 2; stream++) {
+            std::vector<double> one, many, ref;
+            generateNoise(one, n, dt, params[p], 42, stream, 1);
+            generateNoise(many, n, dt, params[p], 42, stream, 4);
+            referenceNoise(ref, n, dt, params[p], 42, stream);
+            threads.expect(one.size() == n && many.size() == n, describe("length, params %zu", p));
+            for (size_t k = 0; k < n; k++) {
+                std::string where = describe("sample %zu params %zu stream %u", k, p, stream);
+                threads.compare(one[k], many[k], 0, where);
+                // the carries are added once per chunk instead of through every sample
+                sequential.compare(ref[k], one[k], 1e-12 * params[p].sd, where);
+            }
+        }
+
+        // 20000 correlation times: the standard error of the moments is about 1% of the SD
+        std::vector<double> trace;
+        generateNoise(trace, lround(20000 * params[p].tau / dt), dt, params[p], 7, 0, 4);
+        ChannelStats st = channelStats(trace.data(), trace.size());
+        double sd = sqrt(st.rms * st.rms - st.mean * st.mean);
+        moments.compare(params[p].mean, st.mean, 0.05 * params[p].sd, describe("mean, params %zu", p));
+        moments.compare(params[p].sd, sd, 0.05 * params[p].sd, describe("SD, params %zu", p));
+    }
+    bool ok = threads.report();
+    ok = sequential.report() && ok;
+    return moments.report() && ok;
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--ulp") && i + 1 < argc) {
+            ulpTolerance = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--pred-ulp") && i + 1 < argc) {
+            predUlpTolerance = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--abs") && i + 1 < argc) {
+            absTolerance = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--verbose")) {
+            verbose = true;
+        } else {
+            fprintf(stderr, "Usage: %s [--ulp N] [--pred-ulp N] [--abs X] [--verbose]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    printf("%-34s %10s %12s %10s  %-6s %s\n", "check", "compared", "max |dev|", "max ULP",
+           "result", "largest deviation at");
+    bool ok = true;
+    ok = testClamp() && ok;
+    ok = testLaserTTL() && ok;
+    ok = testPredictVm() && ok;
+    ok = testStimulusBuffer() && ok;
+    ok = testStats() && ok;
+    ok = testParser() && ok;
+    ok = testNoise() && ok;
+    printf(ok ? "All golden-trace checks passed.\n" : "Golden-trace checks FAILED.\n");
+    return ok ? 0 : 1;
+}